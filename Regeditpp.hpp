@@ -6,6 +6,20 @@
 #include <variant>
 #include <optional>
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <charconv>
+#include <functional>
+#include <memory>
+#include <cstring>
+#include <utility>
+#include <unordered_map>
+#include <cstdint>
+#include <new>
+#include <deque>
 
 using QWORD = uint64_t;
 
@@ -223,6 +237,8 @@ namespace RegeditPP
         }
     };
 
+    class Expander;
+
     template<>
     class Value<Type::UnexpandedString> : public StringValueBase<Type::UnexpandedString>
     {
@@ -236,15 +252,25 @@ namespace RegeditPP
         std::wstring expand() const
         {
             //first get the required length for buffer
-            auto const length = ExpandEnvironmentStringsW(
-                getPointer(),
+            auto length = ExpandEnvironmentStringsW(
+                m_value.c_str(),
                 nullptr,
                 0
             );
-            std::wstring expanded(length, 0);
-            assert(ExpandEnvironmentStringsW(getPointer(), &expanded[0], length) == length);
+            std::wstring expanded;
+            do
+            {
+                expanded.resize(length);
+                length = ExpandEnvironmentStringsW(m_value.c_str(), &expanded[0], static_cast<DWORD>(expanded.size()));
+            } while (length > expanded.size());    //the environment changed in between
+            expanded.resize(length == 0 ? 0 : length - 1);  //without the null terminator
             return expanded;
         }
+
+        /**
+         * @brief Expand with a reusable Expander, which caches the variables and may use another environment
+         */
+        std::wstring expand(Expander& expander) const;
     };
 
 
@@ -266,440 +292,3872 @@ namespace RegeditPP
         constexpr auto static inline Default = AllAccess;
     };
 
-    class Key
+    namespace detail
     {
-        HKEY m_keyHandle{};
-        bool m_keepAlive = true;
-
-        Key(HKEY const currentKey, std::wstring_view subKey, bool keepAlive) : m_keepAlive{ keepAlive }
+        /**
+         * @brief Registry names are compared case-insensitively, one UTF-16 code unit at a time.
+         * The upper case of every code unit is taken once from the invariant locale,
+         * so the result is the same in every process whatever its locale, like CompareStringOrdinal(..., TRUE).
+         */
+        inline wchar_t foldCase(wchar_t c)
         {
-            if (!subKey.empty())
+            constexpr size_t CodeUnits = 0x10000;
+            static auto const table = []
             {
-                auto const result = RegOpenKeyExW(
-                    currentKey,
-                    subKey.data(),
-                    0,
-                    AccessRight::Default,       //TODO
-                    &m_keyHandle
-                );
-                if (result != ERROR_SUCCESS)
+                std::vector<wchar_t> codeUnits(CodeUnits);
+                for (size_t i = 0; i < CodeUnits; ++i)
+                    codeUnits[i] = static_cast<wchar_t>(i);
+                std::vector<wchar_t> upper(CodeUnits);
+                auto const mapped = LCMapStringW(LOCALE_INVARIANT, LCMAP_UPPERCASE,
+                    codeUnits.data(), static_cast<int>(CodeUnits), upper.data(), static_cast<int>(CodeUnits));
+                if (mapped != static_cast<int>(CodeUnits))   //fold ASCII only rather than something locale dependent
                 {
-                    throw std::runtime_error("RegOpenKeyExW failed");
+                    upper = codeUnits;
+                    for (auto c = L'a'; c <= L'z'; ++c)
+                        upper[c] = static_cast<wchar_t>(c - L'a' + L'A');
                 }
+                return upper;
+            }();
+            return static_cast<size_t>(c) < CodeUnits ? table[static_cast<size_t>(c)] : c;
+        }
+
+        /**
+         * @brief Assign the name with every code unit case folded to [folded], see foldCase(), reusing its storage
+         */
+        inline void fold(std::wstring_view name, std::wstring& folded)
+        {
+            folded.assign(name.data(), name.size());
+            for (auto& c : folded)
+                c = foldCase(c);
+        }
+
+        /**
+         * @brief The name with every code unit case folded, see foldCase()
+         */
+        inline std::wstring fold(std::wstring_view name)
+        {
+            std::wstring folded;
+            fold(name, folded);
+            return folded;
+        }
+
+        /**
+         * @brief Compare two names the way the registry orders them, ignoring case
+         */
+        inline int compareIgnoreCase(std::wstring_view lhs, std::wstring_view rhs)
+        {
+            auto const length = (std::min)(lhs.size(), rhs.size());
+            for (size_t i = 0; i < length; ++i)
+            {
+                auto const l = foldCase(lhs[i]);
+                auto const r = foldCase(rhs[i]);
+                if (l != r)
+                    return l < r ? -1 : 1;
             }
+            return lhs.size() == rhs.size() ? 0 : (lhs.size() < rhs.size() ? -1 : 1);
         }
 
-        class UnspecifiedValue
+        /**
+         * @brief Hash and equality of names ignoring case, so that containers of names
+         * can be searched with any spelling without folding a copy first
+         */
+        struct IgnoreCaseHash
         {
-            std::wstring name;
-            HKEY m_keyHandle;
+            size_t operator()(std::wstring_view name) const
+            {
+                uint64_t hash = 14695981039346656037ull;    //FNV-1a of the folded code units
+                for (auto const c : name)
+                    hash = (hash ^ static_cast<uint64_t>(foldCase(c))) * 1099511628211ull;
+                return static_cast<size_t>(hash);
+            }
+        };
 
-            template<typename T>
-            auto valueAs_impl(std::wstring_view name, T* ptr, DWORD bytes) const
+        struct IgnoreCaseEqual
+        {
+            bool operator()(std::wstring_view lhs, std::wstring_view rhs) const
             {
-                RegQueryValueExW(
-                    m_keyHandle,
-                    name.data(),
-                    0,
-                    nullptr,
-                    reinterpret_cast<BYTE*>(ptr),
-                    &bytes
-                );
+                return lhs.size() == rhs.size() && compareIgnoreCase(lhs, rhs) == 0;
             }
-            std::optional<Type> m_type;
-        public:
-            UnspecifiedValue(std::wstring name, HKEY key) :
-                name{std::move(name)},
-                m_keyHandle{key}
-            {}
+        };
 
-            template<Type type>
-            auto as() const
+        /**
+         * @brief Run function(0) ... function(count - 1) on at most hardware_concurrency() threads,
+         * including the calling thread. Exceptions are propagated to the caller.
+         */
+        template<typename Function>
+        void parallelFor(size_t count, Function&& function)
+        {
+            auto const workers = (std::min)(count, static_cast<size_t>((std::max)(1u, std::thread::hardware_concurrency())));
+            std::atomic<size_t> next{};
+            auto work = [&]
             {
-                if constexpr (type == Type::Binary)
-                {
-                    DWORD typeValue{};
-                    DWORD bytes{};
+                for (auto i = next++; i < count; i = next++)
+                    function(i);
+            };
+            std::vector<std::future<void>> futures;
+            for (size_t i = 1; i < workers; ++i)
+                futures.push_back(std::async(std::launch::async, work));
+            work();
+            for (auto& future : futures)
+                future.get();
+        }
 
-                    RegQueryValueExW(
-                        m_keyHandle,    //hkey
-                        name.data(),    //lpValueName
-                        0,              //lpReserved
-                        &typeValue,          //lpType
-                        nullptr,        //lpData
-                        &bytes          //lpcbData
-                    );
+        /**
+         * @brief Run function(i, bool parallelChild) for i in [0, count) while walking a tree.
+         * The walk fans out at the first level that branches: when [parallel] is true and there is more than one,
+         * they run on the worker threads of parallelFor() with parallelChild false, so deeper levels stay on these threads.
+         */
+        template<typename Function>
+        void fanOut(size_t count, bool parallel, Function&& function)
+        {
+            if (parallel && count > 1)
+                parallelFor(count, [&](size_t i) { function(i, false); });
+            else
+            {
+                for (size_t i = 0; i < count; ++i)
+                    function(i, parallel);
+            }
+        }
 
-                    std::vector<BYTE> data(bytes, 0);
-                    valueAs_impl(name, &data[0], bytes);
-                    return Value<Type::Binary>{std::move(name), std::move(data)};
+        /**
+         * @brief Whether [key], opened with REG_OPTION_OPEN_LINK, is a registry symbolic link
+         */
+        inline bool isLink(HKEY key)
+        {
+            DWORD type{};
+            return RegQueryValueExW(key, L"SymbolicLinkValue", nullptr, &type, nullptr, nullptr) == ERROR_SUCCESS && type == REG_LINK;
+        }
+
+        /**
+         * @brief Delete the symbolic link [name] under [parent] itself. RegDeleteKeyW() would follow the link
+         * and delete its target, so the link is opened with REG_OPTION_OPEN_LINK and deleted by handle with NtDeleteKey().
+         */
+        inline LONG deleteLink(HKEY parent, wchar_t const* name)
+        {
+            using NtDeleteKeyFunction = LONG(NTAPI*)(HANDLE);     //returns an NTSTATUS
+            using RtlNtStatusToDosErrorFunction = ULONG(NTAPI*)(LONG);
+            static auto const ntdll = GetModuleHandleW(L"ntdll.dll");
+            //through void(*)(), which any function pointer type may be cast from and to without a warning
+            static auto const ntDeleteKey = reinterpret_cast<NtDeleteKeyFunction>(reinterpret_cast<void(*)()>(GetProcAddress(ntdll, "NtDeleteKey")));
+            static auto const toError = reinterpret_cast<RtlNtStatusToDosErrorFunction>(reinterpret_cast<void(*)()>(GetProcAddress(ntdll, "RtlNtStatusToDosError")));
+            if (!ntDeleteKey || !toError)
+                return ERROR_CALL_NOT_IMPLEMENTED;
+
+            HKEY link{};
+            if (auto const result = RegOpenKeyExW(parent, name, REG_OPTION_OPEN_LINK, DELETE, &link); result != ERROR_SUCCESS)
+                return result;
+            auto const status = ntDeleteKey(link);
+            RegCloseKey(link);
+            return static_cast<LONG>(toError(status));
+        }
+
+        /**
+         * @brief Call function(std::wstring_view name, DWORD type, BYTE const* data, DWORD size) for every value of [key].
+         * The name and data are read into [name] and [data], which are reused across calls,
+         * and [data] grows whenever a value does not fit, after which that value is read again.
+         */
+        template<typename Function>
+        void forEachValue(HKEY key, std::wstring& name, std::vector<BYTE>& data, Function&& function)
+        {
+            if (name.size() < ValueNameMax + 1)
+                name.resize(ValueNameMax + 1);
+            for (DWORD index = 0;;)
+            {
+                DWORD length = static_cast<DWORD>(name.size());
+                DWORD type{};
+                DWORD bytes = static_cast<DWORD>(data.size());
+                auto const result = RegEnumValueW(key, index, &name[0], &length, 0, &type, data.data(), &bytes);
+                if (result == ERROR_MORE_DATA)
+                {
+                    data.resize(bytes);
+                    continue;
                 }
-                else if constexpr (type == Type::Dword)
+                if (result != ERROR_SUCCESS)
+                    break;
+                function(std::wstring_view{ name.data(), length }, type, static_cast<BYTE const*>(data.data()), bytes);
+                ++index;
+            }
+        }
+
+        /**
+         * @brief A single name pattern supporting '*', '?' and character classes like [a-z] or [!0-9]
+         */
+        class Glob
+        {
+            std::wstring m_text;
+            std::wstring m_pattern;     //case folded
+            bool m_literal = true;
+
+            //Advances index past the class if it is well-formed
+            bool matchClass(size_t& index, wchar_t c) const
+            {
+                auto i = index + 1;
+                bool const negate = i < m_pattern.size() && (m_pattern[i] == L'!' || m_pattern[i] == L'^');
+                if (negate)
+                    ++i;
+                bool matched = false;
+                for (auto first = true; i < m_pattern.size() && (m_pattern[i] != L']' || first); first = false)
                 {
-                    DWORD data{};
-                    DWORD bytes = sizeof(DWORD);
-                    RegQueryValueExW(
-                        m_keyHandle,
-                        name.data(),
-                        0,
-                        nullptr,
-                        reinterpret_cast<BYTE*>(&data),
-                        &bytes
-                    );
-                    return Value<Type::Dword>{std::move(name), data};
+                    auto const low = m_pattern[i];
+                    if (i + 2 < m_pattern.size() && m_pattern[i + 1] == L'-' && m_pattern[i + 2] != L']')
+                    {
+                        matched |= (low <= c && c <= m_pattern[i + 2]);
+                        i += 3;
+                    }
+                    else
+                    {
+                        matched |= (low == c);
+                        ++i;
+                    }
                 }
-                else if constexpr (type == Type::Qword)
+                if (i >= m_pattern.size())   //no closing bracket, treat '[' as a literal
                 {
-                    QWORD data{};
-                    DWORD bytes = sizeof(QWORD);
-                    RegQueryValueExW(
-                        m_keyHandle,
-                        name.data(),
-                        0,
-                        nullptr,
-                        reinterpret_cast<BYTE*>(&data),
-                        &bytes
-                    );
-                    return Value<Type::Qword>{std::move(name), data};
+                    ++index;
+                    return c == L'[';
                 }
-                else if constexpr (type == Type::String || type == Type::MultiString || type == Type::UnexpandedString)
+                index = i + 1;
+                return matched != negate;
+            }
+        public:
+            explicit Glob(std::wstring_view pattern) : m_text{ pattern }, m_pattern{ pattern }
+            {
+                for (auto& c : m_pattern)
                 {
-                    DWORD typeValue{};
-                    DWORD bytes{};
-
-                    RegQueryValueExW(
-                        m_keyHandle,    //hkey
-                        name.data(),    //lpValueName
-                        0,              //lpReserved
-                        &typeValue,          //lpType
-                        nullptr,        //lpData
-                        &bytes          //lpcbData
-                    );
-
-                    std::wstring value((bytes / sizeof(wchar_t)) - 1, 0);
-                    valueAs_impl(name, &value[0], bytes);
-                    return Value<type>{std::move(name), std::move(value)};
+                    c = foldCase(c);
+                    if (c == L'*' || c == L'?' || c == L'[')
+                        m_literal = false;
                 }
             }
 
-            template<Type type> 
-            void operator=(Value<type> const& value)
+            /**
+             * @brief Whether the pattern contains no wildcard, so it can be opened directly
+             */
+            bool isLiteral() const
             {
-                RegSetValueExW(
-                    m_keyHandle,                                    //hkey
-                    name.data(),                                    //lpValueName
-                    0,                                              //reserved
-                    static_cast<DWORD>(type),                       //dwType
-                    reinterpret_cast<BYTE const*>(value.getPointer()), //lpData
-                    value.getSize()                                 //cbData
-                );
+                return m_literal;
             }
 
-            Type getType()
+            std::wstring_view getText() const
             {
-                if (m_type.has_value())
-                    return *m_type;
-
-                Type type{};
-                RegQueryValueExW(
-                    m_keyHandle,
-                    name.data(),
-                    0,
-                    reinterpret_cast<DWORD*>(&type),
-                    nullptr,
-                    nullptr
-                );
-                m_type = type;
-                return type;
+                return m_text;
             }
 
-            template<Type type>
-            bool is()
+            bool match(std::wstring_view name) const
             {
-                return type == getType();
+                size_t p = 0, n = 0;
+                auto starP = std::wstring_view::npos;
+                size_t starN = 0;
+                while (n < name.size())
+                {
+                    auto const c = foldCase(name[n]);
+                    if (p < m_pattern.size())
+                    {
+                        auto const pc = m_pattern[p];
+                        if (pc == L'*')
+                        {
+                            starP = ++p;
+                            starN = n;
+                            continue;
+                        }
+                        if (pc == L'?')
+                        {
+                            ++p;
+                            ++n;
+                            continue;
+                        }
+                        if (pc == L'[')
+                        {
+                            auto next = p;
+                            if (matchClass(next, c))
+                            {
+                                p = next;
+                                ++n;
+                                continue;
+                            }
+                        }
+                        else if (pc == c)
+                        {
+                            ++p;
+                            ++n;
+                            continue;
+                        }
+                    }
+                    if (starP == std::wstring_view::npos)
+                        return false;
+                    p = starP;
+                    n = ++starN;
+                }
+                while (p < m_pattern.size() && m_pattern[p] == L'*')
+                    ++p;
+                return p == m_pattern.size();
             }
         };
-    public:
-        constexpr Key(HKEY keyHandle) : m_keyHandle(keyHandle) {}
+    }
 
+    /**
+     * @brief A key path pattern compiled once for Key::query().
+     * Segments are separated by a backslash and matched case-insensitively. A segment is either
+     * - a literal name, which is opened directly without enumerating its siblings
+     * - "*" that matches exactly one key
+     * - "**" that matches any number (including zero) of keys
+     * - a glob with '*', '?' and character classes like [a-z] or [!0-9]
+     */
+    class PathPattern
+    {
+        struct Segment
+        {
+            detail::Glob glob;
+            bool anyDepth;
+        };
+        std::vector<Segment> m_segments;
 
-        template<Type ValueType>
-        Key& operator+=(Value<ValueType> const& value)
+        void add(std::vector<size_t>& states, size_t state) const
         {
-            RegSetValueExW(
-                m_keyHandle,                    //hkey
-                value.m_name.data(),            //lpValueName
-                0,                              //Reserved
-                static_cast<DWORD>(ValueType),  //dwType
-                reinterpret_cast<BYTE const*>(value.getPointer()),         //lpData
-                value.getSize()
-            );
-            return *this;
+            if (std::find(states.cbegin(), states.cend(), state) != states.cend())
+                return;
+            states.push_back(state);
+            if (state < m_segments.size() && m_segments[state].anyDepth)
+                add(states, state + 1);
         }
+    public:
+        /**
+         * @brief The segments that are still being matched at a key
+         */
+        using States = std::vector<size_t>;
 
-
-        Key& operator-=(std::wstring_view valueName)
+        explicit PathPattern(std::wstring_view pattern)
         {
-            RegDeleteValueW(
-                m_keyHandle,        //hkey
-                valueName.data()    //lpValueName
-            );
-            return *this;
+            while (!pattern.empty())
+            {
+                auto const end = pattern.find(L'\\');
+                auto const segment = pattern.substr(0, end);
+                if (!segment.empty())
+                    m_segments.push_back(Segment{ detail::Glob{ segment }, segment == L"**" });
+                if (end == std::wstring_view::npos)
+                    break;
+                pattern.remove_prefix(end + 1);
+            }
         }
 
+        States start() const
+        {
+            States states;
+            add(states, 0);
+            return states;
+        }
 
-        void remove(std::wstring_view subKey, bool recursive = false) const
+        /**
+         * @brief The states of a child named [name], empty if the subtree can be pruned
+         */
+        States next(States const& current, std::wstring_view name) const
         {
-            if (recursive)
-            {
-                RegDeleteTreeW(
-                    m_keyHandle,    //hkey
-                    subKey.data()
-                );
-            }
-            else
+            States states;
+            for (auto const state : current)
             {
-                RegDeleteKeyW(
-                    m_keyHandle,    //hkey
-                    subKey.data()   //lpSubKey
-                );
+                if (state == m_segments.size())
+                    continue;
+                auto const& segment = m_segments[state];
+                if (segment.anyDepth)
+                    add(states, state);
+                else if (segment.glob.match(name))
+                    add(states, state + 1);
             }
+            return states;
         }
 
-        void remove() const
+        bool matches(States const& states) const
         {
-            RegDeleteTreeW(
-                m_keyHandle,
-                nullptr
-            );
+            return std::find(states.cbegin(), states.cend(), m_segments.size()) != states.cend();
         }
 
-        ~Key()
+        bool canDescend(States const& states) const
         {
-            if (!m_keepAlive)
-                [[maybe_unused]] auto const result = RegCloseKey(m_keyHandle);
+            return std::any_of(states.cbegin(), states.cend(), [this](auto state) { return state < m_segments.size(); });
         }
 
-        using ValueVariant = std::variant<
-            Value<Type::Binary>,
-            Value<Type::Dword>,
-            //Value<Type::DwordBigEndian>,
-            Value<Type::UnexpandedString>,
-            //Value<Type::Link>,
-            Value<Type::MultiString>,
-            //Value<Type::None>,
-            Value<Type::Qword>,
-            Value<Type::String>,
-            Key
-        >;
+        /**
+         * @brief When every pending segment is a literal name, returns these names
+         * so that the children can be opened without enumerating the key
+         */
+        std::optional<std::vector<std::wstring_view>> literalChildren(States const& states) const
+        {
+            std::vector<std::wstring_view> names;
+            for (auto const state : states)
+            {
+                if (state == m_segments.size())
+                    continue;
+                auto const& glob = m_segments[state].glob;
+                if (m_segments[state].anyDepth || !glob.isLiteral())
+                    return std::nullopt;
+                if (std::none_of(names.cbegin(), names.cend(), [&glob](auto name) { return glob.match(name); }))
+                    names.push_back(glob.getText());
+            }
+            return names;
+        }
+    };
 
-        struct ChildCount
+    /**
+     * @brief A snapshot of the subkey names of a key for fast lookups.
+     * Like the hash leaves of a hive, the names are sorted case-insensitively,
+     * which gives prefix ranges in O(log n), and hashed ignoring case, which gives lookups by name in O(1)
+     * without a registry call or a folded copy of the name.
+     */
+    class SubKeyIndex
+    {
+        struct Entry
         {
-            DWORD subKeys{};
-            DWORD subKeyMaxLength{};
-            DWORD values{};
-            DWORD valueMaxLength{};
+            std::wstring name;
+            std::wstring folded;
         };
+        std::vector<Entry> m_entries;
+        std::unordered_map<std::wstring_view, size_t, detail::IgnoreCaseHash, detail::IgnoreCaseEqual> m_positions;  //views into m_entries
+        FILETIME m_lastWriteTime{};
+        DWORD m_subKeyCount{};
+    public:
+        using Iterator = std::vector<Entry>::const_iterator;
 
-        class Iterator
+        class Range
         {
-            DWORD m_index{};
-            HKEY m_keyHandle{};
-            ChildCount m_count;
+            Iterator m_begin;
+            Iterator m_end;
         public:
-            Iterator(DWORD index, HKEY key, ChildCount count) :
-                m_index{index},
-                m_keyHandle{key},
-                m_count{count}
+            Range(Iterator begin, Iterator end) : m_begin{ begin }, m_end{ end }
             {
             }
-            auto operator==(Iterator const& rhs) const
+
+            auto begin() const
+            {
+                return m_begin;
+            }
+
+            auto end() const
+            {
+                return m_end;
+            }
+
+            auto size() const
+            {
+                return static_cast<size_t>(m_end - m_begin);
+            }
+
+            auto empty() const
+            {
+                return m_begin == m_end;
+            }
+        };
+
+        explicit SubKeyIndex(HKEY key)
+        {
+            DWORD maxLength{};
+            RegQueryInfoKeyW(key, nullptr, nullptr, 0, &m_subKeyCount, &maxLength, nullptr, nullptr, nullptr, nullptr, nullptr, &m_lastWriteTime);
+
+            m_entries.reserve(m_subKeyCount);
+            std::wstring keyName(KayNameMax + 1, 0);
+            for (DWORD index = 0;; ++index)
+            {
+                DWORD length = KayNameMax + 1;
+                if (RegEnumKeyExW(key, index, &keyName[0], &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                    break;
+                std::wstring_view const name{ keyName.data(), length };
+                m_entries.push_back(Entry{ std::wstring{ name }, detail::fold(name) });
+            }
+            std::sort(m_entries.begin(), m_entries.end(), [](auto const& lhs, auto const& rhs) { return lhs.folded < rhs.folded; });
+
+            m_positions.reserve(m_entries.size());
+            for (size_t i = 0; i < m_entries.size(); ++i)
+                m_positions.emplace(m_entries[i].name, i);
+        }
+
+        SubKeyIndex(SubKeyIndex const&) = delete;
+        SubKeyIndex& operator=(SubKeyIndex const&) = delete;
+
+        /**
+         * @brief Find a subkey by name in any case, returning the name as stored in the registry
+         */
+        std::optional<std::wstring_view> find(std::wstring_view name) const
+        {
+            auto const position = m_positions.find(name);
+            if (position == m_positions.cend())
+                return std::nullopt;
+            return m_entries[position->second].name;
+        }
+
+        bool contains(std::wstring_view name) const
+        {
+            return find(name).has_value();
+        }
+
+        /**
+         * @brief All subkeys whose name starts with [prefix] in any case, in sorted order
+         */
+        Range withPrefix(std::wstring_view prefix) const
+        {
+            auto const folded = detail::fold(prefix);
+            auto const first = std::lower_bound(m_entries.cbegin(), m_entries.cend(), folded,
+                [](Entry const& entry, std::wstring const& value) { return entry.folded < value; });
+            auto const last = std::partition_point(first, m_entries.cend(),
+                [&folded](Entry const& entry) { return entry.folded.compare(0, folded.size(), folded) == 0; });
+            return Range{ first, last };
+        }
+
+        auto begin() const
+        {
+            return m_entries.cbegin();
+        }
+
+        auto end() const
+        {
+            return m_entries.cend();
+        }
+
+        auto size() const
+        {
+            return m_entries.size();
+        }
+
+        /**
+         * @brief The last write time of the key when the index was built
+         */
+        auto const& getLastWriteTime() const
+        {
+            return m_lastWriteTime;
+        }
+
+        /**
+         * @brief The number of subkeys reported by the key when the index was built
+         */
+        auto getSubKeyCount() const
+        {
+            return m_subKeyCount;
+        }
+    };
+
+    /**
+     * @brief Reads the data of a value in chunks.
+     * The registry returns the data of a value as a whole, so it is fetched once into a buffer of exactly its size
+     * (with no intermediate copy) and then handed out chunk by chunk, either copied into caller buffers with read()
+     * or in place with forEachChunk().
+     */
+    class ValueReader
+    {
+        std::unique_ptr<BYTE[]> m_data;
+        DWORD m_size{};
+        DWORD m_position{};
+        Type m_type{};
+    public:
+        ValueReader(HKEY key, std::wstring_view name)
+        {
+            DWORD type{};
+            auto result = RegQueryValueExW(key, name.data(), 0, &type, nullptr, &m_size);
+            while (result == ERROR_SUCCESS)
+            {
+                m_data.reset(new BYTE[(std::max)(m_size, DWORD{ 1 })]);
+                auto bytes = m_size;
+                result = RegQueryValueExW(key, name.data(), 0, &type, m_data.get(), &bytes);
+                if (result == ERROR_MORE_DATA)  //the value grew since the size was read
+                {
+                    m_size = bytes;
+                    result = ERROR_SUCCESS;
+                    continue;
+                }
+                m_size = bytes;
+                break;
+            }
+            if (result != ERROR_SUCCESS)
+            {
+                throw std::runtime_error("RegQueryValueExW failed");
+            }
+            m_type = static_cast<Type>(type);
+        }
+
+        /**
+         * @brief Copy the next chunk of at most [size] bytes into [buffer]
+         * @return The number of bytes copied, 0 at the end of the data
+         */
+        size_t read(void* buffer, size_t size)
+        {
+            auto const bytes = (std::min)(size, static_cast<size_t>(m_size - m_position));
+            if (bytes != 0)
+                std::memcpy(buffer, m_data.get() + m_position, bytes);
+            m_position += static_cast<DWORD>(bytes);
+            return bytes;
+        }
+
+        /**
+         * @brief Call function(BYTE const* chunk, size_t size) for each remaining chunk, without copying
+         */
+        template<typename Function>
+        void forEachChunk(size_t chunkSize, Function&& function)
+        {
+            while (m_position < m_size)
+            {
+                auto const bytes = (std::min)(chunkSize, static_cast<size_t>(m_size - m_position));
+                function(static_cast<BYTE const*>(m_data.get() + m_position), bytes);
+                m_position += static_cast<DWORD>(bytes);
+            }
+        }
+
+        [[nodiscard]] auto getSize() const
+        {
+            return m_size;
+        }
+
+        [[nodiscard]] auto getRemaining() const
+        {
+            return m_size - m_position;
+        }
+
+        [[nodiscard]] auto getType() const
+        {
+            return m_type;
+        }
+    };
+
+    /**
+     * @brief Writes the data of a value in chunks.
+     * The registry sets the data of a value as a whole, so the chunks are appended to one buffer
+     * (generators write into it in place) which is written when commit() is called.
+     * With a [sizeHint] of the final size, the buffer is allocated once at exactly that size.
+     * Otherwise it grows geometrically, without zero-filling, and can reach twice the size of the data.
+     */
+    class ValueWriter
+    {
+        HKEY m_keyHandle{};
+        std::wstring m_name;
+        Type m_type;
+        std::unique_ptr<BYTE[]> m_data;
+        size_t m_size{};
+        size_t m_capacity{};
+
+        void reserve(size_t capacity)
+        {
+            if (capacity <= m_capacity)
+                return;
+            std::unique_ptr<BYTE[]> data{ new BYTE[capacity] };     //left uninitialized
+            if (m_size != 0)
+                std::memcpy(data.get(), m_data.get(), m_size);
+            m_data = std::move(data);
+            m_capacity = capacity;
+        }
+    public:
+        ValueWriter(HKEY key, std::wstring name, Type type, size_t sizeHint = 0) :
+            m_keyHandle{ key },
+            m_name{ std::move(name) },
+            m_type{ type }
+        {
+            reserve(sizeHint);
+        }
+
+        ValueWriter& write(void const* data, size_t size)
+        {
+            if (m_size + size > m_capacity)
+                reserve((std::max)(m_size + size, m_capacity * 2));
+            if (size != 0)
+                std::memcpy(m_data.get() + m_size, data, size);
+            m_size += size;
+            return *this;
+        }
+
+        /**
+         * @brief Fill the data from generator(BYTE* chunk, size_t capacity), which returns the number of bytes
+         * it has written into the chunk, until it returns 0.
+         * Chunks are generated in place in the buffer. When the buffer is full, the next chunk is generated into
+         * a spare one first, so data matching the size hint is never reallocated just to find out that it has ended.
+         */
+        template<typename Generator>
+        ValueWriter& generate(Generator&& generator, size_t chunkSize = 64 * 1024)
+        {
+            std::unique_ptr<BYTE[]> spare;
+            for (;;)
+            {
+                if (m_size == m_capacity)
+                {
+                    if (!spare)
+                        spare.reset(new BYTE[chunkSize]);
+                    auto const bytes = (std::min)(static_cast<size_t>(generator(spare.get(), chunkSize)), chunkSize);
+                    if (bytes == 0)
+                        return *this;
+                    write(spare.get(), bytes);
+                    continue;
+                }
+                auto const capacity = (std::min)(m_capacity - m_size, chunkSize);
+                auto const bytes = (std::min)(static_cast<size_t>(generator(m_data.get() + m_size, capacity)), capacity);
+                if (bytes == 0)
+                    return *this;
+                m_size += bytes;
+            }
+        }
+
+        [[nodiscard]] auto getSize() const
+        {
+            return m_size;
+        }
+
+        /**
+         * @brief Set the value to the data written so far
+         */
+        void commit() const
+        {
+            auto const result = RegSetValueExW(
+                m_keyHandle,
+                m_name.data(),
+                0,
+                static_cast<DWORD>(m_type),
+                m_data.get(),
+                static_cast<DWORD>(m_size)
+            );
+            if (result != ERROR_SUCCESS)
+            {
+                throw std::runtime_error("RegSetValueExW failed");
+            }
+        }
+    };
+
+    /**
+     * @brief Options of Key::removeTree() and Key::prune()
+     */
+    struct RemoveOptions
+    {
+        /**
+         * @brief Called with the number of keys removed so far, after each removed key.
+         * Calls are serialized, but may come from different threads.
+         */
+        std::function<void(size_t removed)> progress;
+
+        /**
+         * @brief When set to true (from any thread), the removal stops as soon as possible
+         */
+        std::atomic<bool> const* cancel = nullptr;
+    };
+
+    /**
+     * @brief The outcome of Key::removeTree() and Key::prune()
+     */
+    struct RemoveResult
+    {
+        size_t removed{};
+        std::vector<std::pair<std::wstring, LONG>> errors;  //path relative to the key, and the error code
+        bool cancelled = false;     //whether any key was left because RemoveOptions::cancel was set
+    };
+
+    /**
+     * @brief An opened registry key. A key owns its handle and closes it in the destructor, so it can be moved but not copied.
+     * Use clone() to open another handle to the same key, or share() to get a reference-counted SharedKey.
+     * The predefined keys and keys constructed from a raw HKEY do not own their handle.
+     *
+     * Thread safety: the registry functions are safe to call concurrently on the same handle,
+     * so any number of threads may call the const member functions of the same Key at the same time.
+     * Moving, assigning and destroying a Key must not race with any other use of it.
+     */
+    class Key
+    {
+        HKEY m_keyHandle{};
+        bool m_owned = false;
+        REGSAM m_access = AccessRight::Default;     //the access the handle was opened with, reused by clone()
+        mutable std::shared_ptr<SubKeyIndex const> m_index;     //built on first use, accessed atomically
+
+        Key(HKEY const currentKey, std::wstring_view subKey)
+        {
+            if (!subKey.empty())
+            {
+                auto const result = RegOpenKeyExW(
+                    currentKey,
+                    subKey.data(),
+                    0,
+                    AccessRight::Default,       //TODO
+                    &m_keyHandle
+                );
+                if (result != ERROR_SUCCESS)
+                {
+                    throw std::runtime_error("RegOpenKeyExW failed");
+                }
+                m_owned = true;
+            }
+        }
+
+        void close() noexcept
+        {
+            if (m_owned)
+                [[maybe_unused]] auto const result = RegCloseKey(m_keyHandle);
+            m_keyHandle = {};
+            m_owned = false;
+            m_index.reset();
+        }
+
+        class UnspecifiedValue
+        {
+            std::wstring name;
+            HKEY m_keyHandle;
+
+            template<typename T>
+            auto valueAs_impl(std::wstring_view name, T* ptr, DWORD bytes) const
+            {
+                RegQueryValueExW(
+                    m_keyHandle,
+                    name.data(),
+                    0,
+                    nullptr,
+                    reinterpret_cast<BYTE*>(ptr),
+                    &bytes
+                );
+            }
+            std::optional<Type> m_type;
+        public:
+            UnspecifiedValue(std::wstring name, HKEY key) :
+                name{std::move(name)},
+                m_keyHandle{key}
+            {}
+
+            template<Type type>
+            auto as() const
+            {
+                if constexpr (type == Type::Binary)
+                {
+                    DWORD typeValue{};
+                    DWORD bytes{};
+
+                    RegQueryValueExW(
+                        m_keyHandle,    //hkey
+                        name.data(),    //lpValueName
+                        0,              //lpReserved
+                        &typeValue,          //lpType
+                        nullptr,        //lpData
+                        &bytes          //lpcbData
+                    );
+
+                    std::vector<BYTE> data(bytes, 0);
+                    valueAs_impl(name, &data[0], bytes);
+                    return Value<Type::Binary>{std::move(name), std::move(data)};
+                }
+                else if constexpr (type == Type::Dword)
+                {
+                    DWORD data{};
+                    DWORD bytes = sizeof(DWORD);
+                    RegQueryValueExW(
+                        m_keyHandle,
+                        name.data(),
+                        0,
+                        nullptr,
+                        reinterpret_cast<BYTE*>(&data),
+                        &bytes
+                    );
+                    return Value<Type::Dword>{std::move(name), data};
+                }
+                else if constexpr (type == Type::Qword)
+                {
+                    QWORD data{};
+                    DWORD bytes = sizeof(QWORD);
+                    RegQueryValueExW(
+                        m_keyHandle,
+                        name.data(),
+                        0,
+                        nullptr,
+                        reinterpret_cast<BYTE*>(&data),
+                        &bytes
+                    );
+                    return Value<Type::Qword>{std::move(name), data};
+                }
+                else if constexpr (type == Type::String || type == Type::MultiString || type == Type::UnexpandedString)
+                {
+                    DWORD typeValue{};
+                    DWORD bytes{};
+
+                    RegQueryValueExW(
+                        m_keyHandle,    //hkey
+                        name.data(),    //lpValueName
+                        0,              //lpReserved
+                        &typeValue,          //lpType
+                        nullptr,        //lpData
+                        &bytes          //lpcbData
+                    );
+
+                    std::wstring value(bytes / sizeof(wchar_t), 0);
+                    valueAs_impl(name, &value[0], bytes);
+                    if (!value.empty() && value.back() == L'\0')   //the data is not always null terminated
+                        value.pop_back();
+                    return Value<type>{std::move(name), std::move(value)};
+                }
+            }
+
+            template<Type type> 
+            void operator=(Value<type> const& value)
+            {
+                RegSetValueExW(
+                    m_keyHandle,                                    //hkey
+                    name.data(),                                    //lpValueName
+                    0,                                              //reserved
+                    static_cast<DWORD>(type),                       //dwType
+                    reinterpret_cast<BYTE const*>(value.getPointer()), //lpData
+                    value.getSize()                                 //cbData
+                );
+            }
+
+            Type getType()
+            {
+                if (m_type.has_value())
+                    return *m_type;
+
+                Type type{};
+                RegQueryValueExW(
+                    m_keyHandle,
+                    name.data(),
+                    0,
+                    reinterpret_cast<DWORD*>(&type),
+                    nullptr,
+                    nullptr
+                );
+                m_type = type;
+                return type;
+            }
+
+            template<Type type>
+            bool is()
+            {
+                return type == getType();
+            }
+        };
+    public:
+        /**
+         * @brief Wraps a handle without taking ownership, for example a predefined key
+         */
+        constexpr Key(HKEY keyHandle) : m_keyHandle(keyHandle) {}
+
+        /**
+         * @brief Takes ownership of a handle, which is closed with RegCloseKey() in the destructor.
+         * [access] is the access the handle was opened with, which clone() requests again.
+         */
+        static Key adopt(HKEY keyHandle, REGSAM access = AccessRight::Default)
+        {
+            Key key{ keyHandle };
+            key.m_owned = true;
+            key.m_access = access;
+            return key;
+        }
+
+        Key(Key const&) = delete;
+        Key& operator=(Key const&) = delete;
+
+        Key(Key&& other) noexcept :
+            m_keyHandle{ std::exchange(other.m_keyHandle, HKEY{}) },
+            m_owned{ std::exchange(other.m_owned, false) },
+            m_access{ other.m_access },
+            m_index{ std::move(other.m_index) }
+        {
+        }
+
+        Key& operator=(Key&& other) noexcept
+        {
+            if (this != &other)
+            {
+                close();
+                m_keyHandle = std::exchange(other.m_keyHandle, HKEY{});
+                m_owned = std::exchange(other.m_owned, false);
+                m_access = other.m_access;
+                m_index = std::move(other.m_index);
+            }
+            return *this;
+        }
+
+
+        template<Type ValueType>
+        Key& operator+=(Value<ValueType> const& value)
+        {
+            RegSetValueExW(
+                m_keyHandle,                    //hkey
+                value.m_name.data(),            //lpValueName
+                0,                              //Reserved
+                static_cast<DWORD>(ValueType),  //dwType
+                reinterpret_cast<BYTE const*>(value.getPointer()),         //lpData
+                value.getSize()
+            );
+            return *this;
+        }
+
+
+        Key& operator-=(std::wstring_view valueName)
+        {
+            RegDeleteValueW(
+                m_keyHandle,        //hkey
+                valueName.data()    //lpValueName
+            );
+            return *this;
+        }
+
+
+        void remove(std::wstring_view subKey, bool recursive = false) const
+        {
+            if (recursive)
+            {
+                RegDeleteTreeW(
+                    m_keyHandle,    //hkey
+                    subKey.data()
+                );
+            }
+            else
+            {
+                RegDeleteKeyW(
+                    m_keyHandle,    //hkey
+                    subKey.data()   //lpSubKey
+                );
+            }
+        }
+
+        void remove() const
+        {
+            RegDeleteTreeW(
+                m_keyHandle,
+                nullptr
+            );
+        }
+
+        /**
+         * @brief Remove [subKey] and everything under it, depth-first, removing independent sibling subtrees in parallel.
+         * Unlike remove(subKey, true), it reports progress, can be cancelled, and collects the errors of each key
+         * instead of stopping at the first one. A symbolic link in the tree is removed itself, its target is never visited.
+         */
+        RemoveResult removeTree(std::wstring_view subKey, RemoveOptions const& options = {}) const
+        {
+            RemoveContext context{ options };
+            std::wstring const name{ subKey };
+            removeImpl(m_keyHandle, name, name, context, true);
+            return context.finish();
+        }
+
+        /**
+         * @brief Walk the tree under this key and remove every subtree for which predicate(std::wstring_view path, ChildInfo const&)
+         * returns true, see RemoveFilter for common predicates. Subtrees that are kept are searched further,
+         * except symbolic links, which are removed like any other key but never followed.
+         * Kept subtrees are searched in parallel, so the predicate is called concurrently from several threads
+         * and must be safe to call that way, like the RemoveFilter predicates, which have no mutable state.
+         */
+        template<typename Predicate>
+        RemoveResult prune(Predicate&& predicate, RemoveOptions const& options = {}) const
+        {
+            RemoveContext context{ options };
+            pruneImpl(*this, std::wstring{}, predicate, context, true);
+            return context.finish();
+        }
+
+        ~Key()
+        {
+            close();
+        }
+
+        /**
+         * @brief Open another handle to the same key, owned by the returned key, with the access this key was opened with
+         */
+        Key clone() const
+        {
+            return clone(m_access);
+        }
+
+        /**
+         * @brief Open another handle to the same key with [access], owned by the returned key
+         */
+        Key clone(REGSAM access) const
+        {
+            HKEY keyHandle{};
+            if (RegOpenKeyExW(m_keyHandle, nullptr, 0, access, &keyHandle) != ERROR_SUCCESS)
+                throw std::runtime_error("RegOpenKeyExW failed");
+            return adopt(keyHandle, access);
+        }
+
+        /**
+         * @brief The access the handle was opened with, AccessRight::Default for keys that do not own their handle
+         */
+        [[nodiscard]] REGSAM getAccess() const
+        {
+            return m_access;
+        }
+
+        /**
+         * @brief Move this key into a reference-counted handle, which is closed when the last copy is destroyed
+         */
+        std::shared_ptr<Key const> share() &&
+        {
+            return std::make_shared<Key const>(std::move(*this));
+        }
+
+        /**
+         * @brief Give up the ownership of the handle, the caller is responsible for closing it
+         */
+        [[nodiscard]] HKEY release() noexcept
+        {
+            m_owned = false;
+            return std::exchange(m_keyHandle, HKEY{});
+        }
+
+        [[nodiscard]] bool ownsHandle() const
+        {
+            return m_owned;
+        }
+
+        using ValueVariant = std::variant<
+            Value<Type::Binary>,
+            Value<Type::Dword>,
+            //Value<Type::DwordBigEndian>,
+            Value<Type::UnexpandedString>,
+            //Value<Type::Link>,
+            Value<Type::MultiString>,
+            //Value<Type::None>,
+            Value<Type::Qword>,
+            Value<Type::String>,
+            Key
+        >;
+
+    private:
+        static bool isSupported(Type type)
+        {
+            switch (type)
+            {
+                case Type::Binary:
+                case Type::Dword:
+                case Type::Qword:
+                case Type::String:
+                case Type::MultiString:
+                case Type::UnexpandedString:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        static ValueVariant readValue(UnspecifiedValue& value)
+        {
+            switch (value.getType())
+            {
+                case Type::Binary:
+                    return ValueVariant{ std::in_place_type<Value<Type::Binary>>, value.as<Type::Binary>() };
+                case Type::Dword:
+                    return ValueVariant{ std::in_place_type<Value<Type::Dword>>, value.as<Type::Dword>() };
+                case Type::Qword:
+                    return ValueVariant{ std::in_place_type<Value<Type::Qword>>, value.as<Type::Qword>() };
+                case Type::String:
+                    return ValueVariant{ std::in_place_type<Value<Type::String>>, value.as<Type::String>() };
+                case Type::MultiString:
+                    return ValueVariant{ std::in_place_type<Value<Type::MultiString>>, value.as<Type::MultiString>()};
+                case Type::UnexpandedString:
+                    return ValueVariant{ std::in_place_type<Value<Type::UnexpandedString>>, value.as<Type::UnexpandedString>() };
+                default:
+                    assert(false);  //Unknown type?
+                    throw std::runtime_error("Unsupported value type");
+            }
+        }
+
+        static std::wstring childPath(std::wstring const& path, std::wstring const& name)
+        {
+            return path.empty() ? name : path + L'\\' + name;
+        }
+
+        template<typename Callback>
+        static void queryImpl(
+            HKEY key,
+            std::wstring const& path,
+            PathPattern const& pattern,
+            PathPattern::States const& states,
+            detail::Glob const& valueFilter,
+            bool parallel,
+            std::mutex& callbackMutex,
+            Callback& callback)
+        {
+            if (pattern.matches(states))
+            {
+                std::wstring valueName(ValueNameMax + 1, 0);
+                for (DWORD index = 0;; ++index)
+                {
+                    DWORD length = ValueNameMax + 1;
+                    if (RegEnumValueW(key, index, &valueName[0], &length, 0, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                        break;
+                    std::wstring_view const name{ valueName.data(), length };
+                    if (!valueFilter.match(name))
+                        continue;
+                    UnspecifiedValue value{ std::wstring{ name }, key };
+                    if (!isSupported(value.getType()))
+                        continue;
+                    auto result = readValue(value);
+                    std::lock_guard lock{ callbackMutex };
+                    callback(std::wstring_view{ path }, std::move(result));
+                }
+            }
+            if (!pattern.canDescend(states))
+                return;
+
+            //Collect the children to visit, so that non-matching subtrees are never opened
+            std::vector<std::pair<std::wstring, PathPattern::States>> children;
+            if (auto const literals = pattern.literalChildren(states))
+            {
+                for (auto const name : *literals)
+                {
+                    if (auto next = pattern.next(states, name); !next.empty())
+                        children.emplace_back(std::wstring{ name }, std::move(next));
+                }
+            }
+            else
+            {
+                std::wstring keyName(KayNameMax + 1, 0);
+                for (DWORD index = 0;; ++index)
+                {
+                    DWORD length = KayNameMax + 1;
+                    if (RegEnumKeyExW(key, index, &keyName[0], &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                        break;
+                    std::wstring_view const name{ keyName.data(), length };
+                    if (auto next = pattern.next(states, name); !next.empty())
+                        children.emplace_back(std::wstring{ name }, std::move(next));
+                }
+            }
+
+            detail::fanOut(children.size(), parallel, [&](size_t i, bool parallelChild)
+            {
+                auto const& [name, next] = children[i];
+                HKEY childHandle{};
+                if (RegOpenKeyExW(key, name.data(), 0, AccessRight::Read, &childHandle) != ERROR_SUCCESS)
+                    return;     //does not exist or no access, nothing can match below
+                auto const child = adopt(childHandle, AccessRight::Read);
+                queryImpl(child.m_keyHandle, childPath(path, name), pattern, next, valueFilter, parallelChild, callbackMutex, callback);
+            });
+        }
+    public:
+
+        struct ChildCount
+        {
+            DWORD subKeys{};
+            DWORD subKeyMaxLength{};
+            DWORD values{};
+            DWORD valueMaxLength{};
+        };
+
+        /**
+         * @brief The metadata of a subkey returned by children()
+         */
+        struct ChildInfo
+        {
+            std::wstring name;
+            std::wstring className;
+            FILETIME lastWriteTime{};
+
+            //Only filled when requested, because the subkey has to be opened
+            DWORD subKeys{};
+            DWORD values{};
+            DWORD maxSubKeyNameLength{};
+            DWORD maxValueNameLength{};
+            DWORD maxValueDataLength{};
+        };
+
+        /**
+         * @brief The total size of a tree, see getTreeSize()
+         */
+        struct TreeSize
+        {
+            size_t keys{};
+            size_t values{};
+            size_t nameBytes{};     //names of the keys and values
+            size_t dataBytes{};
+
+            TreeSize& operator+=(TreeSize const& rhs)
+            {
+                keys += rhs.keys;
+                values += rhs.values;
+                nameBytes += rhs.nameBytes;
+                dataBytes += rhs.dataBytes;
+                return *this;
+            }
+        };
+    private:
+        struct RemoveContext
+        {
+            RemoveOptions const& options;
+            std::mutex mutex;
+            RemoveResult result;
+            std::atomic<bool> skipped{};
+
+            //Whether to skip a key because the removal was cancelled, which is then reported
+            bool cancelled()
+            {
+                if (!options.cancel || !options.cancel->load())
+                    return false;
+                skipped = true;
+                return true;
+            }
+
+            void removed()
+            {
+                std::lock_guard lock{ mutex };
+                ++result.removed;
+                if (options.progress)
+                    options.progress(result.removed);
+            }
+
+            void failed(std::wstring const& path, LONG error)
+            {
+                std::lock_guard lock{ mutex };
+                result.errors.emplace_back(path, error);
+            }
+
+            RemoveResult finish()
+            {
+                result.cancelled = skipped;     //not the flag itself, which may have been set after the last key
+                return std::move(result);
+            }
+        };
+
+
+        static void removeImpl(HKEY parent, std::wstring const& name, std::wstring const& path, RemoveContext& context, bool parallel)
+        {
+            if (context.cancelled())
+                return;
+            HKEY childHandle{};
+            if (auto const result = RegOpenKeyExW(parent, name.data(), REG_OPTION_OPEN_LINK, AccessRight::Read, &childHandle); result != ERROR_SUCCESS)
+            {
+                context.failed(path, result);
+                return;
+            }
+            bool link{};
+            {
+                auto const child = adopt(childHandle, AccessRight::Read);
+                link = detail::isLink(childHandle);
+                std::vector<std::wstring> names;
+                if (!link)      //a link is a leaf, what it points to is outside the tree
+                    child.forEachChild([&names](ChildInfo const& info) { names.push_back(info.name); });
+                detail::fanOut(names.size(), parallel, [&](size_t i, bool parallelChild)
+                {
+                    removeImpl(childHandle, names[i], childPath(path, names[i]), context, parallelChild);
+                });
+            }
+            if (context.cancelled())
+                return;
+            if (auto const result = link ? detail::deleteLink(parent, name.data()) : RegDeleteKeyW(parent, name.data()); result != ERROR_SUCCESS)
+                context.failed(path, result);
+            else
+                context.removed();
+        }
+
+        template<typename Predicate>
+        static void pruneImpl(Key const& key, std::wstring const& path, Predicate& predicate, RemoveContext& context, bool parallel)
+        {
+            std::vector<std::wstring> removed;
+            std::vector<std::wstring> kept;
+            key.forEachChild([&](ChildInfo const& info)
+            {
+                (predicate(std::wstring_view{ childPath(path, info.name) }, info) ? removed : kept).push_back(info.name);
+            });
+            detail::fanOut(removed.size(), parallel, [&](size_t i, bool parallelChild)
+            {
+                removeImpl(key.m_keyHandle, removed[i], childPath(path, removed[i]), context, parallelChild);
+            });
+            detail::fanOut(kept.size(), parallel, [&](size_t i, bool parallelChild)
+            {
+                auto const& name = kept[i];
+                if (context.cancelled())
+                    return;
+                HKEY child{};
+                if (auto const result = RegOpenKeyExW(key.m_keyHandle, name.data(), REG_OPTION_OPEN_LINK, AccessRight::Read, &child); result != ERROR_SUCCESS)
+                {
+                    context.failed(childPath(path, name), result);
+                    return;
+                }
+                auto childKey = adopt(child, AccessRight::Read);
+                if (!detail::isLink(child))     //a kept link is not followed
+                    pruneImpl(childKey, childPath(path, name), predicate, context, parallelChild);
+            });
+        }
+
+        static TreeSize measure(HKEY key, bool recursive)
+        {
+            TreeSize size{ 1 };
+            std::wstring name(ValueNameMax + 1, 0);
+            for (DWORD index = 0;; ++index)
+            {
+                DWORD length = ValueNameMax + 1;
+                DWORD bytes{};
+                if (RegEnumValueW(key, index, &name[0], &length, 0, nullptr, nullptr, &bytes) != ERROR_SUCCESS)
+                    break;
+                ++size.values;
+                size.nameBytes += length * sizeof(wchar_t);
+                size.dataBytes += bytes;
+            }
+            if (!recursive)
+                return size;
+            for (DWORD index = 0;; ++index)
+            {
+                DWORD length = KayNameMax + 1;
+                if (RegEnumKeyExW(key, index, &name[0], &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                    break;
+                HKEY child{};
+                if (RegOpenKeyExW(key, name.data(), 0, AccessRight::Read, &child) != ERROR_SUCCESS)
+                    continue;
+                auto const childKey = adopt(child, AccessRight::Read);
+                size += measure(child, true);
+                size.nameBytes += length * sizeof(wchar_t);
+            }
+            return size;
+        }
+    public:
+
+        class Iterator
+        {
+            DWORD m_index{};
+            HKEY m_keyHandle{};
+            ChildCount m_count;
+        public:
+            Iterator(DWORD index, HKEY key, ChildCount count) :
+                m_index{index},
+                m_keyHandle{key},
+                m_count{count}
+            {
+            }
+            auto operator==(Iterator const& rhs) const
             {
                 return m_index == rhs.m_index && m_keyHandle == rhs.m_keyHandle;
             }
-            auto operator!=(Iterator const& rhs) const
+            auto operator!=(Iterator const& rhs) const
+            {
+                return !(*this == rhs);
+            }
+            Iterator& operator++()
+            {
+                ++m_index;
+                return *this;
+            }
+            Iterator& operator--()
+            {
+                --m_index;
+                return *this;
+            }
+            /**
+             * @brief A subkey is opened for reading only. If that fails (for example, no access), it is an empty Key.
+             */
+            ValueVariant operator*() const
+            {
+                //enumerate keys first
+                if (m_index < m_count.subKeys)
+                {
+                    std::wstring keyName(m_count.subKeyMaxLength, 0);
+                    DWORD bytes = m_count.subKeyMaxLength + 1;
+                    HKEY child{};
+                    if (RegEnumKeyExW(
+                            m_keyHandle,
+                            m_index,
+                            &keyName[0],
+                            &bytes,
+                            0,
+                            nullptr,
+                            nullptr,
+                            nullptr
+                        ) != ERROR_SUCCESS
+                        || RegOpenKeyExW(m_keyHandle, keyName.data(), 0, AccessRight::Read, &child) != ERROR_SUCCESS)
+                    {
+                        return ValueVariant{ std::in_place_type<Key>, Key{ HKEY{} } };
+                    }
+                    return ValueVariant{ std::in_place_type<Key>, Key::adopt(child, AccessRight::Read) };
+                }
+                else
+                {
+                    //enumerate values
+                    std::wstring valueName(m_count.valueMaxLength, 0);
+                    DWORD bytes = m_count.valueMaxLength + 1;
+                    RegEnumValueW(
+                        m_keyHandle,    //hkey
+                        m_index - m_count.subKeys,        //dwIndex
+                        &valueName[0],  //lpValueName
+                        &bytes,         //lpcchValueName
+                        0,              //lpReserved
+                        nullptr,        //lpType
+                        nullptr,        //lpData
+                        nullptr         //lpcbData
+                    );
+                    valueName.resize(bytes);
+                    UnspecifiedValue value{ std::move(valueName), m_keyHandle };
+                    return readValue(value);
+                }
+            }
+        };
+
+        Key operator[](std::wstring_view subKey) const
+        {
+            return Key{ m_keyHandle, subKey };
+        }
+        Key operator[](wchar_t const* subKey) const
+        {
+            return this->operator[](std::wstring_view{ subKey });
+        }
+        ValueVariant operator[](DWORD index) const
+        {
+            return *Iterator{ index, m_keyHandle, getNumChild() };
+        }
+
+        operator bool() const
+        {
+            return m_keyHandle != NULL;
+        }
+
+        Key create(std::wstring_view subKey) const
+        {
+            HKEY keyHandle{};
+            auto result = RegCreateKeyExW(
+                m_keyHandle,
+                subKey.data(),
+                0,
+                nullptr,
+                0,
+                AccessRight::Default,
+                nullptr,
+                &keyHandle,
+                nullptr
+            );
+            if (result != ERROR_SUCCESS)
+            {
+                throw std::runtime_error("RegCreateKeyExW failed");
+            }
+            return adopt(keyHandle);
+        }
+
+        auto valueOf(std::wstring name) const
+        {
+            return UnspecifiedValue{ std::move(name), m_keyHandle };
+        }
+
+        /**
+         * @brief Read the data of a value in chunks, see ValueReader
+         */
+        ValueReader openValueReader(std::wstring_view name) const
+        {
+            return ValueReader{ m_keyHandle, name };
+        }
+
+        /**
+         * @brief Write the data of a value in chunks, see ValueWriter
+         */
+        ValueWriter openValueWriter(std::wstring name, Type type, size_t sizeHint = 0) const
+        {
+            return ValueWriter{ m_keyHandle, std::move(name), type, sizeHint };
+        }
+
+        /**
+         * @brief Set a value from generator(BYTE* chunk, size_t capacity), see ValueWriter::generate().
+         * Pass the expected size of the data as [sizeHint] to have it held in a buffer of exactly that size.
+         */
+        template<typename Generator>
+        void writeValue(std::wstring name, Type type, Generator&& generator, size_t chunkSize = 64 * 1024, size_t sizeHint = 0) const
+        {
+            openValueWriter(std::move(name), type, sizeHint).generate(std::forward<Generator>(generator), chunkSize).commit();
+        }
+
+        /**
+         * @brief Find every value whose name matches [valueFilter] in the subkeys matching [pattern].
+         * Subtrees that cannot match are never opened, and independent branches are evaluated in parallel.
+         * @param callback Called as callback(std::wstring_view path, ValueVariant&& value) for each result,
+         * where path is relative to this key. Calls are serialized, but may come from different threads.
+         * A segment matched by a wildcard is reported with the name stored in the registry, while a literal segment
+         * keeps the spelling of the pattern, because the subkey is opened directly without reading its stored name.
+         */
+        template<typename Callback>
+        void query(PathPattern const& pattern, std::wstring_view valueFilter, Callback&& callback) const
+        {
+            std::mutex callbackMutex;
+            detail::Glob const filter{ valueFilter };
+            queryImpl(m_keyHandle, std::wstring{}, pattern, pattern.start(), filter, true, callbackMutex, callback);
+        }
+
+        template<typename Callback>
+        void query(std::wstring_view pattern, std::wstring_view valueFilter, Callback&& callback) const
+        {
+            query(PathPattern{ pattern }, valueFilter, std::forward<Callback>(callback));
+        }
+
+        /**
+         * @brief Collect the results of query() as (path, value) pairs
+         */
+        auto query(std::wstring_view pattern, std::wstring_view valueFilter = L"*") const
+        {
+            std::vector<std::pair<std::wstring, ValueVariant>> result;
+            query(PathPattern{ pattern }, valueFilter, [&result](std::wstring_view path, ValueVariant&& value)
+            {
+                result.emplace_back(std::wstring{ path }, std::move(value));
+            });
+            return result;
+        }
+
+
+        void rename(std::wstring_view newName) const
+        {
+            RegRenameKey(
+                m_keyHandle,
+                nullptr,
+                newName.data()
+            );
+        }
+
+        void renameSubKey(std::wstring_view subKey, std::wstring_view newName) const
+        {
+            RegRenameKey(
+                m_keyHandle,
+                subKey.data(),
+                newName.data()
+            );
+        }
+
+        /**
+         * @brief The index of the subkey names, built on first use and cached in this key.
+         * The cached index is returned without a registry call, so it does not see subkeys created or deleted
+         * after it was built, call refreshSubKeyIndex() to pick them up.
+         */
+        std::shared_ptr<SubKeyIndex const> subKeyIndex() const
+        {
+            auto index = std::atomic_load(&m_index);
+            if (!index)
+            {
+                index = std::make_shared<SubKeyIndex const>(m_keyHandle);
+                std::atomic_store(&m_index, index);
+            }
+            return index;
+        }
+
+        /**
+         * @brief Rebuild the subkey index if the last write time or the number of subkeys of the key has changed
+         * since it was built, which costs one RegQueryInfoKeyW() when nothing changed.
+         * The last write time only advances with the clock tick, so the number of subkeys catches
+         * subkeys created or deleted within the tick in which the index was built. A subkey deleted and another
+         * one created within that same tick still go unnoticed until the next change of the key.
+         */
+        std::shared_ptr<SubKeyIndex const> refreshSubKeyIndex() const
+        {
+            FILETIME lastWriteTime{};
+            DWORD subKeys{};
+            RegQueryInfoKeyW(m_keyHandle, nullptr, nullptr, 0, &subKeys, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, &lastWriteTime);
+            auto index = std::atomic_load(&m_index);
+            if (!index || index->getSubKeyCount() != subKeys || CompareFileTime(&index->getLastWriteTime(), &lastWriteTime) != 0)
+            {
+                index = std::make_shared<SubKeyIndex const>(m_keyHandle);
+                std::atomic_store(&m_index, index);
+            }
+            return index;
+        }
+
+        /**
+         * @brief Whether a subkey with [name] exists according to the cached subkey index, see subKeyIndex().
+         * It makes no registry call once the index is built.
+         */
+        bool hasSubKey(std::wstring_view name) const
+        {
+            return subKeyIndex()->contains(name);
+        }
+
+        /**
+         * @brief Call callback(ChildInfo const&) for every subkey, reusing the same ChildInfo.
+         * Only the name, class and last write time are read, unless [withCounts] is true,
+         * in which case each subkey is opened briefly to read its counts and maximum lengths.
+         */
+        template<typename Callback>
+        void forEachChild(Callback&& callback, bool withCounts = false) const
+        {
+            ChildInfo info;
+            DWORD maxClassLength{};
+            RegQueryInfoKeyW(m_keyHandle, nullptr, nullptr, 0, nullptr, nullptr, &maxClassLength, nullptr, nullptr, nullptr, nullptr, nullptr);
+            std::wstring nameBuffer(KayNameMax + 1, 0);
+            std::wstring classBuffer(maxClassLength + 1, 0);
+            for (DWORD index = 0;; ++index)
+            {
+                DWORD nameLength = KayNameMax + 1;
+                DWORD classLength = static_cast<DWORD>(classBuffer.size());
+                auto const result = RegEnumKeyExW(m_keyHandle, index, &nameBuffer[0], &nameLength, nullptr, &classBuffer[0], &classLength, &info.lastWriteTime);
+                if (result == ERROR_MORE_DATA)     //a longer class was set meanwhile
+                {
+                    classBuffer.resize(classBuffer.size() * 2);
+                    --index;
+                    continue;
+                }
+                if (result != ERROR_SUCCESS)
+                    break;
+                info.name.assign(nameBuffer.data(), nameLength);
+                info.className.assign(classBuffer.data(), classLength);
+
+                if (withCounts)
+                {
+                    info.subKeys = info.values = info.maxSubKeyNameLength = info.maxValueNameLength = info.maxValueDataLength = 0;
+                    HKEY child{};
+                    if (RegOpenKeyExW(m_keyHandle, info.name.data(), 0, AccessRight::QueryValue, &child) == ERROR_SUCCESS)
+                    {
+                        RegQueryInfoKeyW(
+                            child,
+                            nullptr,
+                            nullptr,
+                            0,
+                            &info.subKeys,
+                            &info.maxSubKeyNameLength,
+                            nullptr,
+                            &info.values,
+                            &info.maxValueNameLength,
+                            &info.maxValueDataLength,
+                            nullptr,
+                            nullptr
+                        );
+                        RegCloseKey(child);
+                    }
+                }
+                callback(static_cast<ChildInfo const&>(info));
+            }
+        }
+
+        /**
+         * @brief The metadata of every subkey, see forEachChild()
+         */
+        std::vector<ChildInfo> children(bool withCounts = false) const
+        {
+            std::vector<ChildInfo> result;
+            result.reserve(getNumChild().subKeys);
+            forEachChild([&result](ChildInfo const& info) { result.push_back(info); }, withCounts);
+            return result;
+        }
+
+        /**
+         * @brief Count the keys, values, and the bytes of names and data of the whole tree under this key (including itself).
+         * The direct subkeys are measured in parallel, and no value data is read.
+         */
+        TreeSize getTreeSize() const
+        {
+            TreeSize total = measure(m_keyHandle, false);
+            auto const names = children();
+            std::vector<TreeSize> sizes(names.size());
+            detail::parallelFor(names.size(), [&](size_t i)
+            {
+                HKEY child{};
+                if (RegOpenKeyExW(m_keyHandle, names[i].name.data(), 0, AccessRight::Read, &child) != ERROR_SUCCESS)
+                    return;
+                auto const childKey = adopt(child, AccessRight::Read);
+                sizes[i] = measure(child, true);
+                sizes[i].nameBytes += names[i].name.size() * sizeof(wchar_t);
+            });
+            for (auto const& size : sizes)
+                total += size;
+            return total;
+        }
+
+        ChildCount getNumChild() const
+        {
+            ChildCount count{};
+            RegQueryInfoKeyW(
+                m_keyHandle,            //hkey
+                nullptr,                //lpClass
+                nullptr,                //lpcchClass
+                0,                      //lpReserved
+                &count.subKeys,         //lpcSubKeys
+                &count.subKeyMaxLength, //lpcbMaxSubkeyLen
+                nullptr,                //lpcbMaxClassLen
+                &count.values,          //lpcValues
+                &count.valueMaxLength,  //lpcbMaxValueLen
+                nullptr,                //lpcbMaxValueLen
+                nullptr,                //lpcbSecurityDescriptor
+                nullptr                 //lpftLastWriteTime
+            );
+            return count;
+        }
+
+        auto begin() const
+        {
+            return Iterator{ 0, m_keyHandle, getNumChild() };
+        }
+
+        auto end() const
+        {
+            auto const numChild = getNumChild();
+            return Iterator{ numChild.subKeys + numChild.values, m_keyHandle, {} };
+        }
+
+        [[nodiscard]]bool isReflectionEnabled() const
+        {
+            BOOL value{};
+            RegQueryReflectionKey(
+                m_keyHandle,    //hBase
+                &value          //bIsReflectionDisabled
+            );
+            return !static_cast<bool>(value);
+        }
+
+
+        void flush() const
+        {
+            RegFlushKey(m_keyHandle);
+        }
+
+        [[nodiscard]] auto getHandle() const
+        {
+            return m_keyHandle;
+        }
+    };
+
+    enum class ExportFormat
+    {
+        JsonLines,  //one JSON object per line
+        Csv         //a header line, then one record per line
+    };
+
+    /**
+     * @brief Streams every value under a key as one record (path, name, type, size, data) per line.
+     * The tree is walked depth-first with reusable buffers, so memory does not grow with the size of the tree,
+     * and the output is buffered into writes of BufferSize bytes.
+     * Data is encoded per type: strings as text, multi-strings as a list, DWORD/QWORD as numbers,
+     * anything else as hex.
+     */
+    class Exporter
+    {
+        std::ostream& m_out;
+        ExportFormat m_format;
+        std::string m_buffer;
+        std::wstring m_path;
+        std::wstring m_valueName = std::wstring(ValueNameMax + 1, 0);
+        std::wstring m_keyName = std::wstring(KayNameMax + 1, 0);
+        std::vector<BYTE> m_data = std::vector<BYTE>(4096);
+        size_t m_records{};
+
+        void appendUtf8(std::wstring_view text)
+        {
+            if (text.empty())
+                return;
+            auto const length = WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), nullptr, 0, nullptr, nullptr);
+            auto const offset = m_buffer.size();
+            m_buffer.resize(offset + length);
+            WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), &m_buffer[offset], length, nullptr, nullptr);
+        }
+
+        void appendText(std::wstring_view text)
+        {
+            auto const offset = m_buffer.size();
+            appendUtf8(text);
+            if (m_format == ExportFormat::JsonLines)
+            {
+                std::string escaped;
+                for (auto i = offset; i < m_buffer.size(); ++i)
+                {
+                    auto const c = static_cast<unsigned char>(m_buffer[i]);
+                    if (c == '"' || c == '\\')
+                    {
+                        escaped += '\\';
+                        escaped += static_cast<char>(c);
+                    }
+                    else if (c < 0x20)
+                    {
+                        char hex[] = "\\u0000";
+                        hex[4] = "0123456789abcdef"[c >> 4];
+                        hex[5] = "0123456789abcdef"[c & 0xf];
+                        escaped += hex;
+                    }
+                    else
+                        escaped += static_cast<char>(c);
+                }
+                m_buffer.replace(offset, std::string::npos, escaped);
+            }
+            else if (m_buffer.find_first_of(",\"\r\n", offset) != std::string::npos)
+            {
+                std::string quoted{ '"' };
+                for (auto i = offset; i < m_buffer.size(); ++i)
+                {
+                    if (m_buffer[i] == '"')
+                        quoted += '"';
+                    quoted += m_buffer[i];
+                }
+                quoted += '"';
+                m_buffer.replace(offset, std::string::npos, quoted);
+            }
+        }
+
+        void appendString(std::wstring_view text)
+        {
+            if (m_format == ExportFormat::JsonLines)
+                m_buffer += '"';
+            appendText(text);
+            if (m_format == ExportFormat::JsonLines)
+                m_buffer += '"';
+        }
+
+        template<typename Integer>
+        void appendNumber(Integer number)
+        {
+            char digits[24];
+            auto const end = std::to_chars(std::begin(digits), std::end(digits), number).ptr;
+            m_buffer.append(digits, end);
+        }
+
+        static char const* typeName(DWORD type)
+        {
+            switch (type)
+            {
+                case REG_NONE: return "REG_NONE";
+                case REG_SZ: return "REG_SZ";
+                case REG_EXPAND_SZ: return "REG_EXPAND_SZ";
+                case REG_BINARY: return "REG_BINARY";
+                case REG_DWORD: return "REG_DWORD";
+                case REG_DWORD_BIG_ENDIAN: return "REG_DWORD_BIG_ENDIAN";
+                case REG_LINK: return "REG_LINK";
+                case REG_MULTI_SZ: return "REG_MULTI_SZ";
+                case REG_QWORD: return "REG_QWORD";
+                default: return nullptr;
+            }
+        }
+
+        void appendData(DWORD type, BYTE const* data, DWORD bytes)
+        {
+            auto const text = [&]
+            {
+                std::wstring_view value{ reinterpret_cast<wchar_t const*>(data), bytes / sizeof(wchar_t) };
+                while (!value.empty() && value.back() == L'\0')
+                    value.remove_suffix(1);
+                return value;
+            };
+            switch (type)
+            {
+                case REG_SZ:
+                case REG_EXPAND_SZ:
+                case REG_LINK:
+                    appendString(text());
+                    return;
+                case REG_MULTI_SZ:
+                {
+                    auto strings = text();
+                    if (m_format == ExportFormat::JsonLines)
+                    {
+                        m_buffer += '[';
+                        for (auto first = true; !strings.empty(); first = false)
+                        {
+                            auto const end = (std::min)(strings.find(L'\0'), strings.size());
+                            if (!first)
+                                m_buffer += ',';
+                            appendString(strings.substr(0, end));
+                            strings.remove_prefix((std::min)(end + 1, strings.size()));
+                        }
+                        m_buffer += ']';
+                    }
+                    else
+                    {
+                        std::wstring lines{ strings };
+                        std::replace(lines.begin(), lines.end(), L'\0', L'\n');
+                        appendText(lines);
+                    }
+                    return;
+                }
+                case REG_DWORD:
+                case REG_DWORD_BIG_ENDIAN:
+                    if (bytes == sizeof(DWORD))
+                    {
+                        DWORD value{};
+                        std::memcpy(&value, data, sizeof(value));
+                        if (type == REG_DWORD_BIG_ENDIAN)
+                            value = (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) | (value << 24);
+                        appendNumber(value);
+                        return;
+                    }
+                    break;
+                case REG_QWORD:
+                    if (bytes == sizeof(QWORD))
+                    {
+                        QWORD value{};
+                        std::memcpy(&value, data, sizeof(value));
+                        appendNumber(value);
+                        return;
+                    }
+                    break;
+            }
+            //binary and malformed data
+            if (m_format == ExportFormat::JsonLines)
+                m_buffer += '"';
+            for (DWORD i = 0; i < bytes; ++i)
+            {
+                m_buffer += "0123456789abcdef"[data[i] >> 4];
+                m_buffer += "0123456789abcdef"[data[i] & 0xf];
+            }
+            if (m_format == ExportFormat::JsonLines)
+                m_buffer += '"';
+        }
+
+        void writeRecord(std::wstring_view name, DWORD type, BYTE const* data, DWORD bytes)
+        {
+            auto const typeText = typeName(type);
+            if (m_format == ExportFormat::JsonLines)
+            {
+                m_buffer += "{\"path\":";
+                appendString(m_path);
+                m_buffer += ",\"name\":";
+                appendString(name);
+                m_buffer += ",\"type\":";
+                if (typeText)
+                    (m_buffer += '"').append(typeText) += '"';
+                else
+                    appendNumber(type);
+                m_buffer += ",\"size\":";
+                appendNumber(bytes);
+                m_buffer += ",\"data\":";
+                appendData(type, data, bytes);
+                m_buffer += "}\n";
+            }
+            else
+            {
+                appendText(m_path);
+                m_buffer += ',';
+                appendText(name);
+                m_buffer += ',';
+                if (typeText)
+                    m_buffer += typeText;
+                else
+                    appendNumber(type);
+                m_buffer += ',';
+                appendNumber(bytes);
+                m_buffer += ',';
+                appendData(type, data, bytes);
+                m_buffer += '\n';
+            }
+            ++m_records;
+            if (m_buffer.size() >= BufferSize)
+                flush();
+        }
+
+        void writeValues(HKEY key)
+        {
+            detail::forEachValue(key, m_valueName, m_data, [this](std::wstring_view name, DWORD type, BYTE const* data, DWORD bytes)
+            {
+                writeRecord(name, type, data, bytes);
+            });
+        }
+
+        void writeKey(HKEY key)
+        {
+            writeValues(key);
+            for (DWORD index = 0;; ++index)
+            {
+                DWORD length = KayNameMax + 1;
+                if (RegEnumKeyExW(key, index, &m_keyName[0], &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                    break;
+                HKEY childHandle{};
+                if (RegOpenKeyExW(key, m_keyName.data(), 0, AccessRight::Read, &childHandle) != ERROR_SUCCESS)
+                    continue;   //skip the subtrees we have no access to
+                auto const child = Key::adopt(childHandle, AccessRight::Read);
+                auto const pathLength = m_path.size();
+                if (!m_path.empty())
+                    m_path += L'\\';
+                m_path.append(m_keyName.data(), length);
+                writeKey(child.getHandle());
+                m_path.resize(pathLength);
+            }
+        }
+    public:
+        constexpr static inline size_t BufferSize = 64 * 1024;
+
+        Exporter(std::ostream& out, ExportFormat format) : m_out{ out }, m_format{ format }
+        {
+            m_buffer.reserve(BufferSize * 2);
+            if (m_format == ExportFormat::Csv)
+                m_buffer += "path,name,type,size,data\n";
+        }
+
+        Exporter(Exporter const&) = delete;
+        Exporter& operator=(Exporter const&) = delete;
+
+        ~Exporter()
+        {
+            flush();
+        }
+
+        /**
+         * @brief Export every value under [key], with paths starting with [path]
+         */
+        Exporter& write(Key const& key, std::wstring_view path = L"")
+        {
+            m_path = path;
+            writeKey(key.getHandle());
+            return *this;
+        }
+
+        void flush()
+        {
+            m_out.write(m_buffer.data(), m_buffer.size());
+            m_buffer.clear();
+            m_out.flush();
+        }
+
+        [[nodiscard]] auto getRecordCount() const
+        {
+            return m_records;
+        }
+
+        /**
+         * @brief Export each direct subkey of [key] in parallel into its own stream.
+         * @param openShard Called with the subkey name (or an empty name for the values of [key] itself)
+         * and returns the stream for that shard, or nullptr to skip it. Calls are serialized, but may come from different threads.
+         * Each stream is then written and destroyed by the thread that opened it, concurrently with the other shards.
+         * @return The total number of records
+         */
+        static size_t writeSharded(
+            Key const& key,
+            ExportFormat format,
+            std::function<std::unique_ptr<std::ostream>(std::wstring_view subtree)> const& openShard,
+            std::wstring_view path = L"")
+        {
+            std::atomic<size_t> records{};
+            std::mutex openMutex;
+            auto const count = key.getNumChild().subKeys;
+            //index 0 is the key itself, the rest are the subkeys, enumerated by index so no list is kept
+            detail::parallelFor(count + 1, [&](size_t i)
+            {
+                std::wstring name;
+                HKEY handle = key.getHandle();
+                if (i != 0)
+                {
+                    name.resize(KayNameMax + 1);
+                    DWORD length = KayNameMax + 1;
+                    if (RegEnumKeyExW(key.getHandle(), static_cast<DWORD>(i - 1), &name[0], &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                        return;
+                    name.resize(length);
+                    if (RegOpenKeyExW(key.getHandle(), name.data(), 0, AccessRight::Read, &handle) != ERROR_SUCCESS)
+                        return;
+                }
+                auto const child = i != 0 ? Key::adopt(handle, AccessRight::Read) : Key{ handle };
+
+                std::unique_ptr<std::ostream> out;
+                {
+                    std::lock_guard lock{ openMutex };
+                    out = openShard(name);
+                }
+                if (!out)
+                    return;
+                Exporter exporter{ *out, format };
+                exporter.m_path = path;
+                if (i == 0)
+                    exporter.writeValues(handle);   //the subkeys are the other shards
+                else
+                {
+                    if (!exporter.m_path.empty())
+                        exporter.m_path += L'\\';
+                    exporter.m_path += name;
+                    exporter.writeKey(handle);
+                }
+                records += exporter.getRecordCount();
+            });
+            return records;
+        }
+    };
+
+    namespace detail
+    {
+        /*
+            Layout of a snapshot image, all offsets are relative to the start of the image:
+            SnapshotHeader | SnapshotKeyRecord[keyCount] | SnapshotValueRecord[valueCount] | names (wchar_t) | data
+            Key 0 is the root. The children of a key, and its values, are stored contiguously
+            and sorted case-insensitively by name, so they can be found by binary search.
+        */
+        constexpr uint32_t SnapshotMagic = 0x53505052;  //"RPPS"
+
+        struct SnapshotHeader
+        {
+            uint32_t magic;
+            uint32_t size;
+            uint64_t generation;
+            uint32_t keyCount;
+            uint32_t valueCount;
+            uint32_t keysOffset;
+            uint32_t valuesOffset;
+            uint32_t namesOffset;
+            uint32_t dataOffset;
+        };
+
+        struct SnapshotKeyRecord
+        {
+            uint32_t nameOffset;    //in characters from namesOffset
+            uint32_t nameLength;
+            uint32_t nameId;        //equal for names that are equal ignoring case
+            uint32_t firstChild;
+            uint32_t childCount;
+            uint32_t firstValue;
+            uint32_t valueCount;
+        };
+
+        struct SnapshotValueRecord
+        {
+            uint32_t nameOffset;
+            uint32_t nameLength;
+            uint32_t nameId;
+            uint32_t type;
+            uint32_t dataOffset;    //in bytes from dataOffset
+            uint32_t dataSize;
+        };
+
+        /**
+         * @brief Whether every offset in a snapshot image of [size] bytes stays inside it,
+         * so it can be read without further checks
+         */
+        inline bool isValidSnapshot(BYTE const* image, size_t size)
+        {
+            if (image == nullptr || size < sizeof(SnapshotHeader))
+                return false;
+            SnapshotHeader header;
+            std::memcpy(&header, image, sizeof(header));
+            auto const fits = [&header](uint64_t offset, uint64_t count, uint64_t elementSize, size_t alignment)
+            {
+                return offset % alignment == 0 && offset + count * elementSize <= header.size;
+            };
+            if (header.magic != SnapshotMagic
+                || header.size > size
+                || header.keyCount == 0
+                || !fits(header.keysOffset, header.keyCount, sizeof(SnapshotKeyRecord), alignof(SnapshotKeyRecord))
+                || !fits(header.valuesOffset, header.valueCount, sizeof(SnapshotValueRecord), alignof(SnapshotValueRecord))
+                || header.namesOffset > header.dataOffset
+                || !fits(header.namesOffset, 0, 1, alignof(wchar_t))
+                || !fits(header.dataOffset, 0, 1, 1))
+                return false;
+
+            uint64_t const nameCount = (header.dataOffset - header.namesOffset) / sizeof(wchar_t);
+            uint64_t const dataSize = header.size - header.dataOffset;
+            auto const keys = reinterpret_cast<SnapshotKeyRecord const*>(image + header.keysOffset);
+            for (uint32_t i = 0; i < header.keyCount; ++i)
+            {
+                auto const& key = keys[i];
+                if (uint64_t{ key.nameOffset } + key.nameLength > nameCount
+                    || uint64_t{ key.firstChild } + key.childCount > header.keyCount
+                    || uint64_t{ key.firstValue } + key.valueCount > header.valueCount)
+                    return false;
+            }
+            auto const values = reinterpret_cast<SnapshotValueRecord const*>(image + header.valuesOffset);
+            for (uint32_t i = 0; i < header.valueCount; ++i)
+            {
+                auto const& value = values[i];
+                if (uint64_t{ value.nameOffset } + value.nameLength > nameCount
+                    || uint64_t{ value.dataOffset } + value.dataSize > dataSize)
+                    return false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief RAII wrapper of a named file mapping and its view
+         */
+        class FileMapping
+        {
+            HANDLE m_handle{};
+            void* m_view{};
+            bool m_existed = false;
+
+            void reset() noexcept
+            {
+                if (m_view)
+                    UnmapViewOfFile(m_view);
+                if (m_handle)
+                    CloseHandle(m_handle);
+                m_view = nullptr;
+                m_handle = {};
+            }
+        public:
+            FileMapping() = default;
+
+            FileMapping(HANDLE handle, DWORD access) : m_handle{ handle }
+            {
+                if (m_handle)
+                    m_view = MapViewOfFile(m_handle, access, 0, 0, 0);
+            }
+
+            FileMapping(FileMapping&& other) noexcept :
+                m_handle{ std::exchange(other.m_handle, HANDLE{}) },
+                m_view{ std::exchange(other.m_view, nullptr) },
+                m_existed{ other.m_existed }
+            {
+            }
+
+            FileMapping& operator=(FileMapping&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    reset();
+                    m_handle = std::exchange(other.m_handle, HANDLE{});
+                    m_view = std::exchange(other.m_view, nullptr);
+                    m_existed = other.m_existed;
+                }
+                return *this;
+            }
+
+            ~FileMapping()
+            {
+                reset();
+            }
+
+            static FileMapping create(std::wstring const& name, size_t size)
+            {
+                auto const handle = CreateFileMappingW(
+                    INVALID_HANDLE_VALUE,                       //backed by the paging file
+                    nullptr,
+                    PAGE_READWRITE,
+                    static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                    static_cast<DWORD>(size),
+                    name.data()
+                );
+                auto const existed = GetLastError() == ERROR_ALREADY_EXISTS;
+                FileMapping mapping{ handle, FILE_MAP_ALL_ACCESS };
+                if (!mapping)
+                    throw std::runtime_error("CreateFileMappingW failed");
+                mapping.m_existed = existed;
+                return mapping;
+            }
+
+            static FileMapping open(std::wstring const& name)
+            {
+                return FileMapping{ OpenFileMappingW(FILE_MAP_READ, FALSE, name.data()), FILE_MAP_READ };
+            }
+
+            void* getView() const
+            {
+                return m_view;
+            }
+
+            /**
+             * @brief The size of the view, which is the size of the mapping rounded up to whole pages
+             */
+            size_t getSize() const
+            {
+                MEMORY_BASIC_INFORMATION info{};
+                if (!m_view || VirtualQuery(m_view, &info, sizeof(info)) == 0)
+                    return 0;
+                return info.RegionSize;
+            }
+
+            /**
+             * @brief Whether create() opened a mapping that was already there
+             */
+            bool alreadyExisted() const
+            {
+                return m_existed;
+            }
+
+            explicit operator bool() const
+            {
+                return m_view != nullptr;
+            }
+        };
+    }
+
+    /**
+     * @brief A value in a snapshot image. Names and data are views into the image, nothing is copied
+     * unless as<>() is called.
+     */
+    class SnapshotValue
+    {
+        BYTE const* m_image;
+        detail::SnapshotValueRecord const* m_record;
+
+        auto const& header() const
+        {
+            return *reinterpret_cast<detail::SnapshotHeader const*>(m_image);
+        }
+    public:
+        SnapshotValue(BYTE const* image, detail::SnapshotValueRecord const* record) : m_image{ image }, m_record{ record }
+        {
+        }
+
+        std::wstring_view getName() const
+        {
+            return { reinterpret_cast<wchar_t const*>(m_image + header().namesOffset) + m_record->nameOffset, m_record->nameLength };
+        }
+
+        /**
+         * @brief Names that are equal ignoring case have equal ids, while getName() keeps the exact spelling
+         */
+        uint32_t getNameId() const
+        {
+            return m_record->nameId;
+        }
+
+        Type getType() const
+        {
+            return static_cast<Type>(m_record->type);
+        }
+
+        BYTE const* getData() const
+        {
+            return m_image + header().dataOffset + m_record->dataOffset;
+        }
+
+        DWORD getSize() const
+        {
+            return m_record->dataSize;
+        }
+
+        /**
+         * @brief The data of a string value without the terminating null characters
+         */
+        std::wstring_view getString() const
+        {
+            std::wstring_view value{ reinterpret_cast<wchar_t const*>(getData()), getSize() / sizeof(wchar_t) };
+            while (!value.empty() && value.back() == L'\0')
+                value.remove_suffix(1);
+            return value;
+        }
+
+        /**
+         * @brief Copy the value into a Value<type>, like Key::valueOf().as<type>()
+         */
+        template<Type type>
+        auto as() const
+        {
+            std::wstring name{ getName() };
+            if constexpr (type == Type::Binary)
+            {
+                return Value<Type::Binary>{ std::move(name), std::vector<BYTE>(getData(), getData() + getSize()) };
+            }
+            else if constexpr (type == Type::Dword || type == Type::Qword)
+            {
+                std::conditional_t<type == Type::Dword, DWORD, QWORD> data{};
+                std::memcpy(&data, getData(), (std::min)(sizeof(data), static_cast<size_t>(getSize())));
+                return Value<type>{ std::move(name), data };
+            }
+            else if constexpr (type == Type::String || type == Type::MultiString || type == Type::UnexpandedString)
+            {
+                std::wstring value{ reinterpret_cast<wchar_t const*>(getData()), getSize() / sizeof(wchar_t) };
+                if (!value.empty() && value.back() == L'\0')
+                    value.pop_back();
+                return Value<type>{ std::move(name), std::move(value) };
+            }
+        }
+    };
+
+    /**
+     * @brief A key in an immutable snapshot image, with the same lookups as Key.
+     * It is only a view, so the image must outlive it.
+     */
+    class SnapshotKey
+    {
+        BYTE const* m_image;
+        detail::SnapshotKeyRecord const* m_record;
+
+        auto const& header() const
+        {
+            return *reinterpret_cast<detail::SnapshotHeader const*>(m_image);
+        }
+
+        auto keyRecords() const
+        {
+            return reinterpret_cast<detail::SnapshotKeyRecord const*>(m_image + header().keysOffset);
+        }
+
+        auto valueRecords() const
+        {
+            return reinterpret_cast<detail::SnapshotValueRecord const*>(m_image + header().valuesOffset);
+        }
+
+        std::wstring_view nameOf(uint32_t offset, uint32_t length) const
+        {
+            return { reinterpret_cast<wchar_t const*>(m_image + header().namesOffset) + offset, length };
+        }
+
+        template<typename Record>
+        Record const* search(Record const* first, uint32_t count, std::wstring_view name) const
+        {
+            auto const last = first + count;
+            auto const found = std::lower_bound(first, last, name, [this](Record const& record, std::wstring_view name)
+            {
+                return detail::compareIgnoreCase(nameOf(record.nameOffset, record.nameLength), name) < 0;
+            });
+            if (found == last || detail::compareIgnoreCase(nameOf(found->nameOffset, found->nameLength), name) != 0)
+                return nullptr;
+            return found;
+        }
+
+        SnapshotKey(BYTE const* image, detail::SnapshotKeyRecord const* record) : m_image{ image }, m_record{ record }
+        {
+        }
+    public:
+        /**
+         * @brief The root key of an image of [size] bytes, which is validated once here
+         */
+        SnapshotKey(BYTE const* image, size_t size) : m_image{ image }
+        {
+            if (!detail::isValidSnapshot(image, size))
+                throw std::runtime_error("Invalid snapshot image");
+            m_record = keyRecords();
+        }
+
+        std::wstring_view getName() const
+        {
+            return nameOf(m_record->nameOffset, m_record->nameLength);
+        }
+
+        /**
+         * @brief Names that are equal ignoring case have equal ids, while getName() keeps the exact spelling
+         */
+        uint32_t getNameId() const
+        {
+            return m_record->nameId;
+        }
+
+        /**
+         * @brief Find a subkey by a path relative to this key
+         */
+        std::optional<SnapshotKey> find(std::wstring_view path) const
+        {
+            auto record = m_record;
+            while (!path.empty())
+            {
+                auto const end = path.find(L'\\');
+                auto const name = path.substr(0, end);
+                if (!name.empty())
+                {
+                    record = search(keyRecords() + record->firstChild, record->childCount, name);
+                    if (!record)
+                        return std::nullopt;
+                }
+                if (end == std::wstring_view::npos)
+                    break;
+                path.remove_prefix(end + 1);
+            }
+            return SnapshotKey{ m_image, record };
+        }
+
+        SnapshotKey operator[](std::wstring_view path) const
+        {
+            if (auto key = find(path))
+                return *key;
+            throw std::runtime_error("Key not found in snapshot");
+        }
+
+        std::optional<SnapshotValue> findValue(std::wstring_view name) const
+        {
+            if (auto const record = search(valueRecords() + m_record->firstValue, m_record->valueCount, name))
+                return SnapshotValue{ m_image, record };
+            return std::nullopt;
+        }
+
+        SnapshotValue valueOf(std::wstring_view name) const
+        {
+            if (auto value = findValue(name))
+                return *value;
+            throw std::runtime_error("Value not found in snapshot");
+        }
+
+        auto getNumChild() const
+        {
+            Key::ChildCount count{};
+            count.subKeys = m_record->childCount;
+            count.values = m_record->valueCount;
+            return count;
+        }
+
+        SnapshotKey child(size_t index) const
+        {
+            return SnapshotKey{ m_image, keyRecords() + m_record->firstChild + index };
+        }
+
+        SnapshotValue value(size_t index) const
+        {
+            return SnapshotValue{ m_image, valueRecords() + m_record->firstValue + index };
+        }
+
+        uint64_t getGeneration() const
+        {
+            return header().generation;
+        }
+    };
+
+    /**
+     * @brief Stores each distinct spelling of a name once, identified by a stable id.
+     * Like the registry, names are also compared case-insensitively: getNameId() gives the same id
+     * to every spelling that is equal ignoring case, namely the id of the first of them that was interned.
+     */
+    class NamePool
+    {
+    public:
+        using Id = uint32_t;
+    private:
+        std::deque<std::wstring> m_names;   //a deque never moves its elements, so the views stay valid
+        std::unordered_map<std::wstring_view, Id> m_ids;
+        std::unordered_map<std::wstring_view, Id, detail::IgnoreCaseHash, detail::IgnoreCaseEqual> m_nameIds;
+        std::vector<Id> m_nameIdOf;     //by Id
+    public:
+        NamePool() = default;
+        NamePool(NamePool const&) = delete;
+        NamePool& operator=(NamePool const&) = delete;
+
+        /**
+         * @brief The id of this exact spelling, stored if it is new
+         */
+        Id intern(std::wstring_view name)
+        {
+            if (auto const found = m_ids.find(name); found != m_ids.cend())
+                return found->second;
+            auto const id = static_cast<Id>(m_names.size());
+            std::wstring_view const stored = m_names.emplace_back(name);
+            m_ids.emplace(stored, id);
+            m_nameIdOf.push_back(m_nameIds.emplace(stored, id).first->second);
+            return id;
+        }
+
+        /**
+         * @brief The id of this exact spelling, if it was interned
+         */
+        std::optional<Id> find(std::wstring_view name) const
+        {
+            if (auto const found = m_ids.find(name); found != m_ids.cend())
+                return found->second;
+            return std::nullopt;
+        }
+
+        /**
+         * @brief The id shared by all the interned spellings that are equal to [id] ignoring case
+         */
+        Id getNameId(Id id) const
+        {
+            return m_nameIdOf[id];
+        }
+
+        /**
+         * @brief The id shared by all the interned spellings that are equal to [name] ignoring case, if any was interned
+         */
+        std::optional<Id> findNameId(std::wstring_view name) const
+        {
+            if (auto const found = m_nameIds.find(name); found != m_nameIds.cend())
+                return found->second;
+            return std::nullopt;
+        }
+
+        std::wstring_view view(Id id) const
+        {
+            return m_names[id];
+        }
+
+        auto size() const
+        {
+            return m_names.size();
+        }
+    };
+
+    struct SnapshotOptions
+    {
+        bool internNames = true;    //store each distinct spelling of a name once
+        bool dedupData = false;     //store identical data once, found by content hash
+    };
+
+    /**
+     * @brief How much interning and deduplication saved in a snapshot image
+     */
+    struct SnapshotStats
+    {
+        size_t names{};
+        size_t uniqueNames{};
+        size_t nameBytes{};         //of all the names
+        size_t storedNameBytes{};   //in the image
+        size_t values{};
+        size_t dataBytes{};
+        size_t storedDataBytes{};
+    };
+
+    /**
+     * @brief Builds a snapshot image of a tree in the live registry
+     */
+    class SnapshotBuilder
+    {
+        SnapshotOptions m_options;
+        SnapshotStats m_stats;
+        std::vector<detail::SnapshotKeyRecord> m_keys;
+        std::vector<detail::SnapshotValueRecord> m_values;
+        std::wstring m_names;
+        std::vector<BYTE> m_data;
+        NamePool m_pool;    //gives the name ids, whether or not the names are stored once
+        std::vector<uint32_t> m_nameOffsets;    //by NamePool::Id, NotStored until the spelling is stored
+        std::unordered_multimap<size_t, std::pair<uint32_t, uint32_t>> m_blobs;    //content hash -> (offset, size)
+
+        constexpr static uint32_t NotStored = UINT32_MAX;
+
+        //Stores the exact spelling of the name of a key or value record, and its case-insensitive id
+        template<typename Record>
+        void setName(Record& record, std::wstring_view name)
+        {
+            ++m_stats.names;
+            m_stats.nameBytes += name.size() * sizeof(wchar_t);
+            auto const id = m_pool.intern(name);
+            record.nameLength = static_cast<uint32_t>(name.size());
+            record.nameId = m_pool.getNameId(id);
+            if (m_options.internNames)
+            {
+                if (id >= m_nameOffsets.size())
+                    m_nameOffsets.resize(id + 1, NotStored);
+                if (m_nameOffsets[id] != NotStored)
+                {
+                    record.nameOffset = m_nameOffsets[id];
+                    return;
+                }
+                m_nameOffsets[id] = static_cast<uint32_t>(m_names.size());
+            }
+            ++m_stats.uniqueNames;
+            record.nameOffset = static_cast<uint32_t>(m_names.size());
+            m_names += name;
+        }
+
+        uint32_t addData(std::vector<BYTE> const& data)
+        {
+            ++m_stats.values;
+            m_stats.dataBytes += data.size();
+            size_t hash{};
+            if (m_options.dedupData)
+            {
+                hash = std::hash<std::string_view>{}({ reinterpret_cast<char const*>(data.data()), data.size() });
+                auto const [first, last] = m_blobs.equal_range(hash);
+                for (auto blob = first; blob != last; ++blob)
+                {
+                    auto const [offset, size] = blob->second;
+                    if (size == data.size() && (size == 0 || std::memcmp(m_data.data() + offset, data.data(), size) == 0))
+                        return offset;
+                }
+            }
+            auto const offset = static_cast<uint32_t>(m_data.size());
+            m_data.insert(m_data.end(), data.cbegin(), data.cend());
+            if (m_options.dedupData)
+                m_blobs.emplace(hash, std::pair{ offset, static_cast<uint32_t>(data.size()) });
+            return offset;
+        }
+
+        void addValues(HKEY key, detail::SnapshotKeyRecord& record)
+        {
+            struct Entry
+            {
+                std::wstring name;
+                DWORD type;
+                std::vector<BYTE> data;
+            };
+            std::vector<Entry> entries;
+            std::wstring name;
+            std::vector<BYTE> data(4096);
+            detail::forEachValue(key, name, data, [&entries](std::wstring_view valueName, DWORD type, BYTE const* valueData, DWORD bytes)
+            {
+                entries.push_back(Entry{ std::wstring{ valueName }, type, std::vector<BYTE>(valueData, valueData + bytes) });
+            });
+            std::sort(entries.begin(), entries.end(), [](auto const& lhs, auto const& rhs) { return detail::compareIgnoreCase(lhs.name, rhs.name) < 0; });
+
+            record.firstValue = static_cast<uint32_t>(m_values.size());
+            record.valueCount = static_cast<uint32_t>(entries.size());
+            for (auto const& entry : entries)
+            {
+                detail::SnapshotValueRecord value{};
+                setName(value, entry.name);
+                value.type = entry.type;
+                value.dataOffset = addData(entry.data);
+                value.dataSize = static_cast<uint32_t>(entry.data.size());
+                m_values.push_back(value);
+            }
+        }
+
+        void addKey(HKEY key, size_t index)
+        {
+            addValues(key, m_keys[index]);
+
+            std::vector<std::wstring> names;
+            std::wstring name(KayNameMax + 1, 0);
+            for (DWORD i = 0;; ++i)
+            {
+                DWORD length = KayNameMax + 1;
+                if (RegEnumKeyExW(key, i, &name[0], &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                    break;
+                names.push_back(name.substr(0, length));
+            }
+            std::sort(names.begin(), names.end(), [](auto const& lhs, auto const& rhs) { return detail::compareIgnoreCase(lhs, rhs) < 0; });
+
+            //the children are allocated contiguously before descending into any of them
+            auto const firstChild = m_keys.size();
+            m_keys[index].firstChild = static_cast<uint32_t>(firstChild);
+            m_keys[index].childCount = static_cast<uint32_t>(names.size());
+            for (auto const& childName : names)
+                setName(m_keys.emplace_back(), childName);
+
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                HKEY child{};
+                if (RegOpenKeyExW(key, names[i].data(), 0, AccessRight::Read, &child) != ERROR_SUCCESS)
+                    continue;   //kept as an empty key
+                auto const childKey = Key::adopt(child, AccessRight::Read);
+                addKey(child, firstChild + i);
+            }
+        }
+    public:
+        /**
+         * @brief Build the image of the tree under [key]
+         * @param generation A number identifying this version of the image
+         * @param stats If not null, receives how much interning and deduplication saved
+         */
+        static std::vector<BYTE> build(Key const& key, uint64_t generation = 0, SnapshotOptions options = {}, SnapshotStats* stats = nullptr)
+        {
+            SnapshotBuilder builder;
+            builder.m_options = options;
+            builder.m_keys.push_back(detail::SnapshotKeyRecord{});
+            builder.m_pool.intern({});  //the empty name of the root has id 0
+            builder.addKey(key.getHandle(), 0);
+            if (stats)
+            {
+                *stats = builder.m_stats;
+                stats->storedNameBytes = builder.m_names.size() * sizeof(wchar_t);
+                stats->storedDataBytes = builder.m_data.size();
+            }
+            return builder.finish(generation);
+        }
+
+    private:
+        std::vector<BYTE> finish(uint64_t generation) const
+        {
+            auto const keysOffset = sizeof(detail::SnapshotHeader);
+            auto const valuesOffset = keysOffset + m_keys.size() * sizeof(detail::SnapshotKeyRecord);
+            auto const namesOffset = valuesOffset + m_values.size() * sizeof(detail::SnapshotValueRecord);
+            auto const dataOffset = namesOffset + m_names.size() * sizeof(wchar_t);
+            auto const size = dataOffset + m_data.size();
+            if (size > UINT32_MAX)
+                throw std::length_error("Snapshot image is too large");
+
+            detail::SnapshotHeader const header{
+                detail::SnapshotMagic,
+                static_cast<uint32_t>(size),
+                generation,
+                static_cast<uint32_t>(m_keys.size()),
+                static_cast<uint32_t>(m_values.size()),
+                static_cast<uint32_t>(keysOffset),
+                static_cast<uint32_t>(valuesOffset),
+                static_cast<uint32_t>(namesOffset),
+                static_cast<uint32_t>(dataOffset)
+            };
+            std::vector<BYTE> image(size);
+            std::memcpy(image.data(), &header, sizeof(header));
+            std::memcpy(image.data() + keysOffset, m_keys.data(), m_keys.size() * sizeof(detail::SnapshotKeyRecord));
+            if (!m_values.empty())
+                std::memcpy(image.data() + valuesOffset, m_values.data(), m_values.size() * sizeof(detail::SnapshotValueRecord));
+            if (!m_names.empty())
+                std::memcpy(image.data() + namesOffset, m_names.data(), m_names.size() * sizeof(wchar_t));
+            if (!m_data.empty())
+                std::memcpy(image.data() + dataOffset, m_data.data(), m_data.size());
+            return image;
+        }
+    };
+
+    /**
+     * @brief A snapshot image published by a ConfigServer, mapped read-only into this process
+     */
+    class SharedSnapshot
+    {
+        detail::FileMapping m_mapping;
+        SnapshotKey m_root;
+    public:
+        explicit SharedSnapshot(detail::FileMapping mapping) :
+            m_mapping{ std::move(mapping) },
+            m_root{ static_cast<BYTE const*>(m_mapping.getView()), m_mapping.getSize() }
+        {
+        }
+
+        /**
+         * @brief The root key, valid as long as this snapshot
+         */
+        SnapshotKey const& root() const
+        {
+            return m_root;
+        }
+
+        uint64_t getGeneration() const
+        {
+            return m_root.getGeneration();
+        }
+    };
+
+    /**
+     * @brief Publishes a subtree of the registry as an immutable snapshot image in shared memory,
+     * so that many processes can read it through a ConfigClient without any registry call or copy.
+     * Each update is published as a new generation in its own mapping named "Local\RegeditPP.<name>.<generation>",
+     * and the current generation is announced in the mapping "Local\RegeditPP.<name>".
+     * Clients keep the generation they have mapped until they ask for the current one again.
+     *
+     * The source is always a key of the live registry. Clients validate every image once when they map it,
+     * so a malformed or truncated image is rejected instead of being read out of bounds, but any process of
+     * the session can create these mappings, so the names only identify, and do not authenticate, the server.
+     */
+    class ConfigServer
+    {
+        std::wstring m_name;
+        Key m_source;
+        detail::FileMapping m_directory;
+        detail::FileMapping m_current;
+        uint64_t m_generation{};
+        HANDLE m_changed{};
+
+        void watch()
+        {
+            auto const result = RegNotifyChangeKeyValue(
+                m_source.getHandle(),
+                TRUE,                                                   //bWatchSubtree
+                REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET,
+                m_changed,
+                TRUE                                                    //fAsynchronous
+            );
+            if (result != ERROR_SUCCESS)
+            {
+                throw std::runtime_error("RegNotifyChangeKeyValue failed");
+            }
+        }
+    public:
+        static std::wstring mappingName(std::wstring_view name)
+        {
+            return L"Local\\RegeditPP." + std::wstring{ name };
+        }
+
+        static std::wstring mappingName(std::wstring_view name, uint64_t generation)
+        {
+            return mappingName(name) + L'.' + std::to_wstring(generation);
+        }
+
+        /**
+         * @brief Start serving [source] under [name] and publish the first generation
+         */
+        ConfigServer(std::wstring name, Key source) :
+            m_name{ std::move(name) },
+            m_source{ std::move(source) },
+            m_directory{ detail::FileMapping::create(mappingName(m_name), sizeof(std::atomic<uint64_t>)) },
+            m_changed{ CreateEventW(nullptr, FALSE, FALSE, nullptr) }
+        {
+            if (!m_changed)
+                throw std::runtime_error("CreateEventW failed");
+            auto const generation = static_cast<std::atomic<uint64_t>*>(m_directory.getView());
+            if (m_directory.alreadyExisted())
+            {
+                if (m_directory.getSize() < sizeof(std::atomic<uint64_t>))
+                {
+                    CloseHandle(m_changed);
+                    throw std::runtime_error("Invalid config server mapping");
+                }
+                m_generation = generation->load();  //still held by clients of a previous server, continue its generations
+            }
+            else
+                new (generation) std::atomic<uint64_t>{};
+            try
+            {
+                watch();
+                publish();
+            }
+            catch (...)
+            {
+                CloseHandle(m_changed);
+                throw;
+            }
+        }
+
+        ConfigServer(ConfigServer const&) = delete;
+        ConfigServer& operator=(ConfigServer const&) = delete;
+
+        ~ConfigServer()
+        {
+            CloseHandle(m_changed);
+        }
+
+        /**
+         * @brief Build a new image of the source and make it the current generation
+         */
+        void publish()
+        {
+            auto const image = SnapshotBuilder::build(m_source, m_generation + 1);
+            auto mapping = detail::FileMapping::create(mappingName(m_name, m_generation + 1), image.size());
+            if (mapping.alreadyExisted())
+                throw std::runtime_error("Snapshot generation is already published");
+            std::memcpy(mapping.getView(), image.data(), image.size());
+
+            ++m_generation;
+            static_cast<std::atomic<uint64_t>*>(m_directory.getView())->store(m_generation, std::memory_order_release);
+            m_current = std::move(mapping);     //clients that mapped the old generation keep it alive
+        }
+
+        /**
+         * @brief Wait up to [timeoutMilliseconds] for a change under the source key, and publish a new generation if there is one
+         * @return Whether a new generation was published
+         */
+        bool publishOnChange(DWORD timeoutMilliseconds = INFINITE)
+        {
+            if (WaitForSingleObject(m_changed, timeoutMilliseconds) != WAIT_OBJECT_0)
+                return false;
+            watch();
+            publish();
+            return true;
+        }
+
+        [[nodiscard]] auto getGeneration() const
+        {
+            return m_generation;
+        }
+    };
+
+    /**
+     * @brief Reads the snapshots published by a ConfigServer with the same name
+     */
+    class ConfigClient
+    {
+        std::wstring m_name;
+        detail::FileMapping m_directory;
+        std::shared_ptr<SharedSnapshot const> m_current;
+    public:
+        explicit ConfigClient(std::wstring name) :
+            m_name{ std::move(name) },
+            m_directory{ detail::FileMapping::open(ConfigServer::mappingName(m_name)) }
+        {
+            if (!m_directory)
+                throw std::runtime_error("Config server not found");
+            if (m_directory.getSize() < sizeof(std::atomic<uint64_t>))
+                throw std::runtime_error("Invalid config server mapping");
+        }
+
+        /**
+         * @brief The current generation, which is mapped again only when the server has published a new one.
+         * The returned snapshot stays valid (and unchanged) as long as it is held.
+         */
+        std::shared_ptr<SharedSnapshot const> current()
+        {
+            auto const& published = *static_cast<std::atomic<uint64_t> const*>(m_directory.getView());
+            for (;;)
+            {
+                auto const generation = published.load(std::memory_order_acquire);
+                if (m_current && m_current->getGeneration() == generation)
+                    return m_current;
+                auto mapping = detail::FileMapping::open(ConfigServer::mappingName(m_name, generation));
+                if (mapping)
+                {
+                    m_current = std::make_shared<SharedSnapshot const>(std::move(mapping));
+                    return m_current;
+                }
+                if (published.load(std::memory_order_acquire) == generation)
+                    throw std::runtime_error("Config server has stopped");
+                //otherwise a newer generation replaced it meanwhile, try again
+            }
+        }
+    };
+
+    namespace detail
+    {
+        /**
+         * @brief A minimal compressor for the LZ4 block format, so that no library has to be linked
+         */
+        inline std::vector<BYTE> lz4Compress(BYTE const* source, size_t size)
+        {
+            constexpr size_t MinMatch = 4;
+            constexpr size_t LastLiterals = 5;      //the last 5 bytes are always literals
+            constexpr size_t MatchFindLimit = 12;   //the last match starts at least 12 bytes before the end
+            constexpr auto HashBits = 12;
+
+            std::vector<BYTE> output;
+            output.reserve(size + size / 255 + 16);
+            auto const writeLength = [&output](size_t length)
+            {
+                for (; length >= 255; length -= 255)
+                    output.push_back(255);
+                output.push_back(static_cast<BYTE>(length));
+            };
+            auto const read32 = [source](size_t position)
+            {
+                uint32_t value;
+                std::memcpy(&value, source + position, sizeof(value));
+                return value;
+            };
+            auto const emit = [&](size_t anchor, size_t literals, size_t matchLength)
+            {
+                auto const token = static_cast<BYTE>(((std::min)(literals, size_t{ 15 }) << 4) | (std::min)(matchLength, size_t{ 15 }));
+                output.push_back(token);
+                if (literals >= 15)
+                    writeLength(literals - 15);
+                output.insert(output.end(), source + anchor, source + anchor + literals);
+            };
+
+            size_t anchor = 0;
+            if (size > MatchFindLimit)
+            {
+                std::vector<size_t> table(size_t{ 1 } << HashBits, SIZE_MAX);
+                auto const matchLimit = size - LastLiterals;
+                auto const inputLimit = size - MatchFindLimit;
+                for (size_t i = 0; i < inputLimit;)
+                {
+                    auto const sequence = read32(i);
+                    auto const hash = (sequence * 2654435761u) >> (32 - HashBits);
+                    auto const candidate = table[hash];
+                    table[hash] = i;
+                    if (candidate == SIZE_MAX || i - candidate > 65535 || read32(candidate) != sequence)
+                    {
+                        ++i;
+                        continue;
+                    }
+                    auto length = MinMatch;
+                    while (i + length < matchLimit && source[candidate + length] == source[i + length])
+                        ++length;
+
+                    emit(anchor, i - anchor, length - MinMatch);
+                    auto const offset = i - candidate;
+                    output.push_back(static_cast<BYTE>(offset));
+                    output.push_back(static_cast<BYTE>(offset >> 8));
+                    if (length - MinMatch >= 15)
+                        writeLength(length - MinMatch - 15);
+                    i += length;
+                    anchor = i;
+                }
+            }
+            emit(anchor, size - anchor, 0);
+            return output;
+        }
+
+        /**
+         * @brief Decompress an LZ4 block into exactly [size] bytes
+         */
+        inline void lz4Decompress(BYTE const* source, size_t sourceSize, BYTE* destination, size_t size)
+        {
+            auto const corrupted = [] { throw std::runtime_error("Corrupted LZ4 block"); };
+            auto input = source;
+            auto const inputEnd = source + sourceSize;
+            auto output = destination;
+            auto const outputEnd = destination + size;
+            auto const readLength = [&](size_t length)
+            {
+                if (length == 15)
+                {
+                    BYTE byte{};
+                    do
+                    {
+                        if (input == inputEnd)
+                            corrupted();
+                        byte = *input++;
+                        length += byte;
+                    } while (byte == 255);
+                }
+                return length;
+            };
+
+            while (input < inputEnd)
+            {
+                auto const token = *input++;
+                auto const literals = readLength(token >> 4);
+                if (static_cast<size_t>(inputEnd - input) < literals || static_cast<size_t>(outputEnd - output) < literals)
+                    corrupted();
+                std::memcpy(output, input, literals);
+                input += literals;
+                output += literals;
+                if (input == inputEnd)
+                    break;  //the last sequence has no match
+
+                if (inputEnd - input < 2)
+                    corrupted();
+                size_t const offset = input[0] | (input[1] << 8);
+                input += 2;
+                auto const length = readLength(token & 15) + 4;
+                if (offset == 0 || offset > static_cast<size_t>(output - destination) || static_cast<size_t>(outputEnd - output) < length)
+                    corrupted();
+                if (offset >= length)
+                    std::memcpy(output, output - offset, length);
+                else
+                {
+                    for (size_t i = 0; i < length; ++i)     //the match overlaps the output
+                        output[i] = output[i - offset];
+                }
+                output += length;
+            }
+            if (output != outputEnd)
+                corrupted();
+        }
+
+        /**
+         * @brief Compare two key paths segment by segment ignoring case,
+         * which is the order of a depth-first walk with sorted subkeys.
+         * It only depends on foldCase(), which does not depend on the locale, so it can be stored on disk.
+         */
+        inline int comparePaths(std::wstring_view lhs, std::wstring_view rhs)
+        {
+            for (;;)
+            {
+                auto const lhsEnd = lhs.find(L'\\');
+                auto const rhsEnd = rhs.find(L'\\');
+                if (auto const result = compareIgnoreCase(lhs.substr(0, lhsEnd), rhs.substr(0, rhsEnd)); result != 0)
+                    return result;
+                if (lhsEnd == std::wstring_view::npos || rhsEnd == std::wstring_view::npos)
+                    return lhsEnd == rhsEnd ? 0 : (lhsEnd == std::wstring_view::npos ? -1 : 1);
+                lhs.remove_prefix(lhsEnd + 1);
+                rhs.remove_prefix(rhsEnd + 1);
+            }
+        }
+
+        constexpr uint32_t ArchiveMagic = 0x41505052;   //"RPPA"
+        constexpr uint32_t ArchiveVersion = 2;          //paths sorted with the invariant case folding, index in the trailer
+
+        /*
+            Layout of an archive, written front to back so the output does not need to be seekable:
+            ArchiveHeader | compressed blocks | index | ArchiveTrailer
+            A block holds the records of consecutive keys in depth-first order (sorted by comparePaths), each record being
+                uint32 pathLength, wchar_t path[pathLength], uint32 valueCount,
+                { uint32 nameLength, wchar_t name[nameLength], uint32 type, uint32 size, BYTE data[size] }[valueCount]
+            The index holds, for every block,
+                uint64 offset, uint32 compressedSize, uint32 size, uint32 firstPathLength, wchar_t firstPath[firstPathLength]
+        */
+        struct ArchiveHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+        };
+
+        struct ArchiveTrailer
+        {
+            uint64_t indexOffset;
+            uint32_t blockCount;
+            uint32_t magic;
+        };
+    }
+
+    /**
+     * @brief A value read back from an Archive
+     */
+    struct ArchivedValue
+    {
+        std::wstring name;
+        Type type;
+        std::vector<BYTE> data;
+    };
+
+    /**
+     * @brief A key read back from an Archive, with its path relative to the archived key
+     */
+    struct ArchivedKey
+    {
+        std::wstring path;
+        std::vector<ArchivedValue> values;
+    };
+
+    /**
+     * @brief Writes a tree into an archive of independently LZ4-compressed blocks with a sparse index of paths,
+     * so that reading one key only decompresses its block. Blocks are compressed in parallel.
+     */
+    class ArchiveWriter
+    {
+        struct Block
+        {
+            std::vector<BYTE> data;
+            std::wstring firstPath;
+            std::vector<BYTE> compressed;
+        };
+
+        std::ostream& m_out;
+        size_t m_blockSize;
+        uint64_t m_offset{};
+        std::vector<Block> m_pending;   //filled blocks waiting to be compressed
+        std::vector<BYTE> m_index;
+        uint32_t m_blockCount{};
+        std::wstring m_path;
+        std::wstring m_valueName = std::wstring(ValueNameMax + 1, 0);
+        std::vector<BYTE> m_valueData = std::vector<BYTE>(4096);
+
+        template<typename T>
+        static void append(std::vector<BYTE>& buffer, T const& value)
+        {
+            auto const bytes = reinterpret_cast<BYTE const*>(&value);
+            buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+        }
+
+        static void append(std::vector<BYTE>& buffer, std::wstring_view text)
+        {
+            append(buffer, static_cast<uint32_t>(text.size()));
+            auto const bytes = reinterpret_cast<BYTE const*>(text.data());
+            buffer.insert(buffer.end(), bytes, bytes + text.size() * sizeof(wchar_t));
+        }
+
+        Block& currentBlock()
+        {
+            if (m_pending.empty() || m_pending.back().data.size() >= m_blockSize)
+            {
+                if (m_pending.size() == m_pending.capacity())
+                    flushBlocks();
+                m_pending.push_back(Block{});
+                m_pending.back().data.reserve(m_blockSize * 2);
+                m_pending.back().firstPath = m_path;
+            }
+            return m_pending.back();
+        }
+
+        void flushBlocks()
+        {
+            detail::parallelFor(m_pending.size(), [this](size_t i)
             {
-                return !(*this == rhs);
+                auto& block = m_pending[i];
+                block.compressed = detail::lz4Compress(block.data.data(), block.data.size());
+            });
+            for (auto const& block : m_pending)
+            {
+                m_out.write(reinterpret_cast<char const*>(block.compressed.data()), block.compressed.size());
+                append(m_index, m_offset);
+                append(m_index, static_cast<uint32_t>(block.compressed.size()));
+                append(m_index, static_cast<uint32_t>(block.data.size()));
+                append(m_index, std::wstring_view{ block.firstPath });
+                m_offset += block.compressed.size();
+                ++m_blockCount;
             }
-            Iterator& operator++()
+            m_pending.clear();
+        }
+
+        void writeKey(HKEY key)
+        {
+            auto& block = currentBlock().data;
+            append(block, std::wstring_view{ m_path });
+            auto const countOffset = block.size();
+            append(block, uint32_t{});
+            uint32_t count{};
+            detail::forEachValue(key, m_valueName, m_valueData, [&](std::wstring_view name, DWORD type, BYTE const* data, DWORD bytes)
             {
-                ++m_index;
-                return *this;
+                append(block, name);
+                append(block, static_cast<uint32_t>(type));
+                append(block, static_cast<uint32_t>(bytes));
+                block.insert(block.end(), data, data + bytes);
+                ++count;
+            });
+            std::memcpy(block.data() + countOffset, &count, sizeof(count));
+
+            //the subkeys are visited in sorted order, so that the paths in the archive are sorted
+            std::vector<std::wstring> names;
+            for (DWORD index = 0;; ++index)
+            {
+                DWORD length = KayNameMax + 1;
+                if (RegEnumKeyExW(key, index, &m_valueName[0], &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                    break;
+                names.push_back(m_valueName.substr(0, length));
             }
-            Iterator& operator--()
+            std::sort(names.begin(), names.end(), [](auto const& lhs, auto const& rhs) { return detail::compareIgnoreCase(lhs, rhs) < 0; });
+            for (auto const& name : names)
             {
-                --m_index;
-                return *this;
+                HKEY child{};
+                if (RegOpenKeyExW(key, name.data(), 0, AccessRight::Read, &child) != ERROR_SUCCESS)
+                    continue;
+                auto const childKey = Key::adopt(child, AccessRight::Read);
+                auto const pathLength = m_path.size();
+                if (!m_path.empty())
+                    m_path += L'\\';
+                m_path += name;
+                writeKey(child);
+                m_path.resize(pathLength);
             }
-            ValueVariant operator*() const
+        }
+
+        ArchiveWriter(std::ostream& out, size_t blockSize) :
+            m_out{ out },
+            m_blockSize{ blockSize }
+        {
+            m_pending.reserve(2 * static_cast<size_t>((std::max)(1u, std::thread::hardware_concurrency())));
+        }
+    public:
+        constexpr static inline size_t DefaultBlockSize = 16 * 1024;
+
+        /**
+         * @brief Write the tree under [key] as an archive into [out], which is written sequentially and never sought
+         * @param blockSize The uncompressed size a block is filled up to. Smaller blocks make lookups faster and compression worse.
+         * @return The number of blocks
+         */
+        static size_t write(Key const& key, std::ostream& out, size_t blockSize = DefaultBlockSize)
+        {
+            ArchiveWriter writer{ out, blockSize };
+            detail::ArchiveHeader const header{ detail::ArchiveMagic, detail::ArchiveVersion };
+            out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            writer.m_offset = sizeof(header);
+
+            writer.writeKey(key.getHandle());
+            writer.flushBlocks();
+
+            detail::ArchiveTrailer const trailer{ writer.m_offset, writer.m_blockCount, detail::ArchiveMagic };
+            out.write(reinterpret_cast<char const*>(writer.m_index.data()), writer.m_index.size());
+            out.write(reinterpret_cast<char const*>(&trailer), sizeof(trailer));
+            if (!out)
+                throw std::runtime_error("Writing the archive failed");
+            return writer.m_blockCount;
+        }
+    };
+
+    /**
+     * @brief Random access by key path into an archive written by ArchiveWriter, either held in memory or read from a stream.
+     * Only the sparse index is read up front; a lookup reads and decompresses the one block that can hold the key,
+     * so a stream (for example a std::ifstream) is never read as a whole.
+     * Lookups are safe to run concurrently.
+     */
+    class Archive
+    {
+        struct IndexEntry
+        {
+            uint64_t offset;
+            uint32_t compressedSize;
+            uint32_t size;
+            std::wstring firstPath;
+        };
+        struct CachedBlock
+        {
+            size_t index;
+            std::vector<BYTE> data;
+        };
+
+        std::vector<BYTE> m_bytes;                  //the whole archive, when it is held in memory
+        std::unique_ptr<std::istream> m_stream;     //otherwise
+        mutable std::mutex m_streamMutex;
+        uint64_t m_size{};
+        std::vector<IndexEntry> m_index;
+        mutable std::shared_ptr<CachedBlock const> m_cache;    //the last decompressed block, accessed atomically
+
+        template<typename T>
+        static T read(BYTE const*& position, BYTE const* end)
+        {
+            if (static_cast<size_t>(end - position) < sizeof(T))
+                throw std::runtime_error("Corrupted archive");
+            T value;
+            std::memcpy(&value, position, sizeof(T));
+            position += sizeof(T);
+            return value;
+        }
+
+        static void skip(BYTE const*& position, BYTE const* end, size_t bytes)
+        {
+            if (static_cast<size_t>(end - position) < bytes)
+                throw std::runtime_error("Corrupted archive");
+            position += bytes;
+        }
+
+        static std::wstring_view readText(BYTE const*& position, BYTE const* end, std::wstring& storage)
+        {
+            auto const length = read<uint32_t>(position, end);
+            if (static_cast<size_t>(end - position) / sizeof(wchar_t) < length)
+                throw std::runtime_error("Corrupted archive");
+            storage.resize(length);
+            std::memcpy(&storage[0], position, length * sizeof(wchar_t));
+            position += length * sizeof(wchar_t);
+            return storage;
+        }
+
+        /**
+         * @brief [size] bytes at [offset] of the archive, pointing into the archive in memory or read into [buffer]
+         */
+        BYTE const* bytesAt(uint64_t offset, size_t size, std::vector<BYTE>& buffer) const
+        {
+            if (offset > m_size || size > m_size - offset)
+                throw std::runtime_error("Corrupted archive");
+            if (!m_stream)
+                return m_bytes.data() + offset;
+            buffer.resize(size);
+            std::lock_guard lock{ m_streamMutex };
+            m_stream->clear();
+            m_stream->seekg(static_cast<std::streamoff>(offset));
+            m_stream->read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(size));
+            if (!*m_stream)
+                throw std::runtime_error("Reading the archive failed");
+            return buffer.data();
+        }
+
+        void readIndex()
+        {
+            std::vector<BYTE> buffer;
+            if (m_size < sizeof(detail::ArchiveHeader) + sizeof(detail::ArchiveTrailer))
+                throw std::runtime_error("Invalid archive");
+            detail::ArchiveHeader header;
+            std::memcpy(&header, bytesAt(0, sizeof(header), buffer), sizeof(header));
+            if (header.magic != detail::ArchiveMagic || header.version != detail::ArchiveVersion)
+                throw std::runtime_error("Invalid archive");
+            auto const trailerOffset = m_size - sizeof(detail::ArchiveTrailer);
+            detail::ArchiveTrailer trailer;
+            std::memcpy(&trailer, bytesAt(trailerOffset, sizeof(trailer), buffer), sizeof(trailer));
+            if (trailer.magic != detail::ArchiveMagic || trailer.indexOffset < sizeof(header) || trailer.indexOffset > trailerOffset)
+                throw std::runtime_error("Invalid archive");
+
+            auto position = bytesAt(trailer.indexOffset, static_cast<size_t>(trailerOffset - trailer.indexOffset), buffer);
+            auto const end = position + (trailerOffset - trailer.indexOffset);
+            m_index.reserve((std::min)(trailer.blockCount, static_cast<uint32_t>((end - position) / (sizeof(uint64_t) + 3 * sizeof(uint32_t)))));
+            for (uint32_t i = 0; i < trailer.blockCount; ++i)
             {
-                //enumerate keys first
-                if (m_index < m_count.subKeys)
-                {
-                    std::wstring keyName(m_count.subKeyMaxLength, 0);
-                    DWORD bytes = m_count.subKeyMaxLength + 1;
-                    RegEnumKeyExW(
-                        m_keyHandle,
-                        m_index,
-                        &keyName[0],
-                        &bytes,
-                        0,
-                        nullptr,
-                        nullptr,
-                        nullptr
-                    );
-                    return ValueVariant{ std::in_place_type<Key>, Key{m_keyHandle, L"", true}};
-                }
-                else
+                IndexEntry entry{};
+                entry.offset = read<uint64_t>(position, end);
+                entry.compressedSize = read<uint32_t>(position, end);
+                entry.size = read<uint32_t>(position, end);
+                readText(position, end, entry.firstPath);
+                if (entry.offset + entry.compressedSize > trailer.indexOffset)
+                    throw std::runtime_error("Invalid archive");
+                m_index.push_back(std::move(entry));
+            }
+        }
+
+        std::shared_ptr<CachedBlock const> block(size_t index) const
+        {
+            auto cached = std::atomic_load(&m_cache);
+            if (cached && cached->index == index)
+                return cached;
+            auto const& entry = m_index[index];
+            std::vector<BYTE> buffer;
+            auto const compressed = bytesAt(entry.offset, entry.compressedSize, buffer);
+            auto decompressed = std::make_shared<CachedBlock>(CachedBlock{ index, std::vector<BYTE>(entry.size) });
+            detail::lz4Decompress(compressed, entry.compressedSize, decompressed->data.data(), entry.size);
+            std::atomic_store(&m_cache, std::shared_ptr<CachedBlock const>{ decompressed });
+            return decompressed;
+        }
+    public:
+        /**
+         * @brief Open an archive from its bytes
+         */
+        explicit Archive(std::vector<BYTE> bytes) : m_bytes{ std::move(bytes) }, m_size{ m_bytes.size() }
+        {
+            readIndex();
+        }
+
+        /**
+         * @brief Open an archive from a seekable stream (opened in binary mode), reading only its index for now
+         */
+        explicit Archive(std::unique_ptr<std::istream> stream) : m_stream{ std::move(stream) }
+        {
+            if (!m_stream || !m_stream->seekg(0, std::ios::end))
+                throw std::runtime_error("The archive stream is not seekable");
+            auto const size = m_stream->tellg();
+            if (size < 0)
+                throw std::runtime_error("The archive stream is not seekable");
+            m_size = static_cast<uint64_t>(size);
+            readIndex();
+        }
+
+        /**
+         * @brief Find a key by its path relative to the archived key (an empty path for the archived key itself)
+         */
+        std::optional<ArchivedKey> find(std::wstring_view path) const
+        {
+            //the last block whose first path is not after [path]
+            auto const next = std::upper_bound(m_index.cbegin(), m_index.cend(), path, [](std::wstring_view path, IndexEntry const& entry)
+            {
+                return detail::comparePaths(path, entry.firstPath) < 0;
+            });
+            if (next == m_index.cbegin())
+                return std::nullopt;
+            auto const data = block(static_cast<size_t>(next - m_index.cbegin()) - 1);
+
+            auto position = data->data.data();
+            auto const end = position + data->data.size();
+            std::wstring recordPath;
+            while (position < end)
+            {
+                readText(position, end, recordPath);
+                auto const count = read<uint32_t>(position, end);
+                if (detail::comparePaths(recordPath, path) != 0)
                 {
-                    //enumerate values
-                    std::wstring valueName(m_count.valueMaxLength, 0);
-                    DWORD bytes = m_count.valueMaxLength + 1;
-                    RegEnumValueW(
-                        m_keyHandle,    //hkey
-                        m_index - m_count.subKeys,        //dwIndex
-                        &valueName[0],  //lpValueName
-                        &bytes,         //lpcchValueName
-                        0,              //lpReserved
-                        nullptr,        //lpType
-                        nullptr,        //lpData
-                        nullptr         //lpcbData
-                    );
-                    //Get type
-                    UnspecifiedValue value{ valueName, m_keyHandle };
-                    switch (value.getType())
+                    for (uint32_t i = 0; i < count; ++i)    //skip the values
                     {
-                        case Type::Binary:
-                            return ValueVariant{ std::in_place_type<Value<Type::Binary>>, value.as<Type::Binary>() };
-                        case Type::Dword:
-                            return ValueVariant{ std::in_place_type<Value<Type::Dword>>, value.as<Type::Dword>() };
-                        case Type::Qword:
-                            return ValueVariant{ std::in_place_type<Value<Type::Qword>>, value.as<Type::Qword>() };
-                        case Type::String:
-                            return ValueVariant{ std::in_place_type<Value<Type::String>>, value.as<Type::String>() };
-                        case Type::MultiString:
-                            return ValueVariant{ std::in_place_type<Value<Type::MultiString>>, value.as<Type::MultiString>()};
-                        case Type::UnexpandedString:
-                            return ValueVariant{ std::in_place_type<Value<Type::UnexpandedString>>, value.as<Type::UnexpandedString>() };
-                        default:
-                            assert(false);  //Unknown type?
+                        skip(position, end, read<uint32_t>(position, end) * sizeof(wchar_t));
+                        skip(position, end, sizeof(uint32_t));  //type
+                        skip(position, end, read<uint32_t>(position, end));
                     }
+                    continue;
+                }
+
+                ArchivedKey key{ std::move(recordPath) };
+                key.values.reserve(count);
+                for (uint32_t i = 0; i < count; ++i)
+                {
+                    ArchivedValue value{};
+                    readText(position, end, value.name);
+                    value.type = static_cast<Type>(read<uint32_t>(position, end));
+                    auto const size = read<uint32_t>(position, end);
+                    if (static_cast<size_t>(end - position) < size)
+                        throw std::runtime_error("Corrupted archive");
+                    value.data.assign(position, position + size);
+                    position += size;
+                    key.values.push_back(std::move(value));
                 }
+                return key;
             }
-        };
+            return std::nullopt;
+        }
 
-        Key operator[](std::wstring_view subKey) const
+        [[nodiscard]] auto getBlockCount() const
         {
-            return Key{ m_keyHandle, subKey, true };
+            return m_index.size();
         }
-        Key operator[](wchar_t const* subKey) const
+    };
+
+    /**
+     * @brief Predicates for Key::prune()
+     */
+    struct RemoveFilter
+    {
+        /**
+         * @brief Keys last written before [time]
+         */
+        static auto olderThan(FILETIME time)
         {
-            return this->operator[](std::wstring_view{ subKey });
+            return [time](std::wstring_view, Key::ChildInfo const& info)
+            {
+                return CompareFileTime(&info.lastWriteTime, &time) < 0;
+            };
         }
-        ValueVariant operator[](DWORD index) const
+
+        /**
+         * @brief Keys whose name matches a glob with '*', '?' and character classes, ignoring case
+         */
+        static auto nameMatches(std::wstring_view pattern)
         {
-            return *Iterator{ index, m_keyHandle, getNumChild() };
+            return [glob = detail::Glob{ pattern }](std::wstring_view, Key::ChildInfo const& info)
+            {
+                return glob.match(info.name);
+            };
         }
+    };
 
-        operator bool() const
+    struct RegistryQuota
+    {
+        DWORD allowed{};
+        DWORD used{};
+    };
+
+    /**
+     * @brief The current size of the registry and the maximum size it is allowed to reach, in bytes
+     */
+    inline RegistryQuota getRegistryQuota()
+    {
+        RegistryQuota quota;
+        GetSystemRegistryQuota(&quota.allowed, &quota.used);
+        return quota;
+    }
+
+    /**
+     * @brief The environment variables an Expander looks up, either
+     * - the live environment of this process
+     * - a copy of it (or of any set of variables) captured at some point, for example from the Environment keys of an offline profile
+     * - any lookup function
+     * Names are case-insensitive.
+     */
+    class Environment
+    {
+        using Lookup = std::function<std::optional<std::wstring>(std::wstring_view name)>;
+        Lookup m_lookup;
+        std::unordered_map<std::wstring, std::wstring> m_variables;    //by folded name, used when there is no lookup
+
+        explicit Environment(Lookup lookup) : m_lookup{ std::move(lookup) }
         {
-            return m_keyHandle != NULL;
         }
+    public:
+        /**
+         * @brief An empty set of variables
+         */
+        Environment() = default;
 
-        Key create(std::wstring_view subKey) const
+        /**
+         * @brief The live environment of this process
+         */
+        static Environment process()
         {
-            HKEY keyHandle{};
-            auto result = RegCreateKeyExW(
-                m_keyHandle,
-                subKey.data(),
-                0,
-                nullptr,
-                0,
-                AccessRight::Default,
-                nullptr,
-                &keyHandle,
-                nullptr
-            );
-            return Key{keyHandle};
+            return Environment{ [](std::wstring_view name) -> std::optional<std::wstring>
+            {
+                std::wstring const variable{ name };
+                std::wstring value(64, 0);
+                for (;;)
+                {
+                    SetLastError(ERROR_SUCCESS);
+                    auto const length = GetEnvironmentVariableW(variable.data(), &value[0], static_cast<DWORD>(value.size()));
+                    if (length == 0)    //either undefined or defined as empty, which replaces a reference with nothing
+                    {
+                        if (GetLastError() == ERROR_ENVVAR_NOT_FOUND)
+                            return std::nullopt;
+                        return std::wstring{};
+                    }
+                    if (length < value.size())
+                    {
+                        value.resize(length);
+                        return value;
+                    }
+                    value.resize(length);   //too small, length includes the null terminator
+                }
+            } };
         }
 
-        auto valueOf(std::wstring name) const
+        /**
+         * @brief A copy of the current environment of this process
+         */
+        static Environment capture()
         {
-            return UnspecifiedValue{ std::move(name), m_keyHandle };
+            Environment environment;
+            auto const block = GetEnvironmentStringsW();
+            for (auto entry = block; entry && *entry; entry += std::wcslen(entry) + 1)
+            {
+                std::wstring_view const variable{ entry };
+                auto const separator = variable.find(L'=', 1);    //names of hidden variables like "=C:" start with '='
+                if (separator != std::wstring_view::npos)
+                    environment.set(variable.substr(0, separator), std::wstring{ variable.substr(separator + 1) });
+            }
+            FreeEnvironmentStringsW(block);
+            return environment;
         }
 
+        /**
+         * @brief Look up variables with a function returning std::optional<std::wstring>
+         */
+        static Environment custom(Lookup lookup)
+        {
+            return Environment{ std::move(lookup) };
+        }
 
-        void rename(std::wstring_view newName) const
+        /**
+         * @brief Set a variable of a captured environment
+         */
+        Environment& set(std::wstring_view name, std::wstring value)
         {
-            RegRenameKey(
-                m_keyHandle,
-                nullptr,
-                newName.data()
-            );
+            if (m_lookup)
+                throw std::logic_error("Only captured environments can be modified");
+            m_variables[detail::fold(name)] = std::move(value);
+            return *this;
         }
 
-        void renameSubKey(std::wstring_view subKey, std::wstring_view newName) const
+        /**
+         * @brief Add the variables stored in an Environment key, such as
+         * HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Control\Session Manager\Environment or HKEY_CURRENT_USER\Environment.
+         * Like Windows does when building a profile, REG_EXPAND_SZ values are expanded with the variables set so far.
+         */
+        Environment& load(Key const& key);
+
+        std::optional<std::wstring> get(std::wstring_view name) const
         {
-            RegRenameKey(
-                m_keyHandle,
-                subKey.data(),
-                newName.data()
-            );
+            if (m_lookup)
+                return m_lookup(name);
+            if (auto const found = m_variables.find(detail::fold(name)); found != m_variables.cend())
+                return found->second;
+            return std::nullopt;
         }
+    };
 
-        ChildCount getNumChild() const
+    /**
+     * @brief Expands %variable% references like ExpandEnvironmentStringsW, for many strings at once.
+     * The parsed form of each string and the value of each variable are cached,
+     * so a variable is looked up once however many strings refer to it. Call clearCache() to see changes of the environment.
+     * References to undefined variables are kept, and the '%' that would close them may start the next reference.
+     */
+    class Expander
+    {
+        Environment m_environment;
+        //the offset and length of the text between the '%' of every string. Whether a '%' closes a reference
+        //depends on whether the variable is defined, so that is decided when expanding, not here
+        std::unordered_map<std::wstring, std::vector<std::pair<size_t, size_t>>> m_parsed;
+        std::unordered_map<std::wstring, std::optional<std::wstring>> m_variables;  //by folded name
+        std::wstring m_key;
+        std::wstring m_folded;
+        std::wstring m_buffer;
+
+        std::vector<std::pair<size_t, size_t>> const& parse(std::wstring_view text)
         {
-            ChildCount count{};
-            RegQueryInfoKeyW(
-                m_keyHandle,            //hkey
-                nullptr,                //lpClass
-                nullptr,                //lpcchClass
-                0,                      //lpReserved
-                &count.subKeys,         //lpcSubKeys
-                &count.subKeyMaxLength, //lpcbMaxSubkeyLen
-                nullptr,                //lpcbMaxClassLen
-                &count.values,          //lpcValues
-                &count.valueMaxLength,  //lpcbMaxValueLen
-                nullptr,                //lpcbMaxValueLen
-                nullptr,                //lpcbSecurityDescriptor
-                nullptr                 //lpftLastWriteTime
-            );
-            return count;
+            m_key.assign(text.data(), text.size());
+            if (auto const found = m_parsed.find(m_key); found != m_parsed.cend())
+                return found->second;
+            if (m_parsed.size() >= ParsedCacheSize)
+                m_parsed.clear();
+
+            std::vector<std::pair<size_t, size_t>> segments;
+            for (size_t start = 0;;)
+            {
+                auto const percent = text.find(L'%', start);
+                if (percent == std::wstring_view::npos)
+                {
+                    segments.emplace_back(start, text.size() - start);
+                    break;
+                }
+                segments.emplace_back(start, percent - start);
+                start = percent + 1;
+            }
+            return m_parsed.emplace(m_key, std::move(segments)).first->second;
         }
 
-        auto begin() const
+        std::optional<std::wstring> const& variable(std::wstring_view name)
         {
-            return Iterator{ 0, m_keyHandle, getNumChild() };
+            detail::fold(name, m_folded);
+            if (auto const found = m_variables.find(m_folded); found != m_variables.cend())
+                return found->second;
+            return m_variables.emplace(m_folded, m_environment.get(name)).first->second;
         }
 
-        auto end() const
+        /**
+         * @brief Like ExpandEnvironmentStringsW: a '%' starts a reference if another '%' follows.
+         * A defined variable replaces the whole reference, otherwise only the opening '%' is copied
+         * and the closing one may start the next reference.
+         */
+        void append(std::wstring& output, std::wstring_view text)
         {
-            auto const numChild = getNumChild();
-            return Iterator{ numChild.subKeys + numChild.values, m_keyHandle, {} };
+            auto const& segments = parse(text);
+            auto const segment = [&](size_t i) { return text.substr(segments[i].first, segments[i].second); };
+            auto const last = segments.size() - 1;  //the number of '%'
+            output += segment(0);
+            for (size_t i = 1; i <= last;)
+            {
+                if (i < last && segments[i].second != 0)
+                {
+                    if (auto const& value = variable(segment(i)))
+                    {
+                        (output += *value) += segment(i + 1);
+                        i += 2;
+                        continue;
+                    }
+                }
+                (output += L'%') += segment(i);
+                ++i;
+            }
         }
+    public:
+        constexpr static inline size_t ParsedCacheSize = 4096;
 
-        [[nodiscard]]bool isReflectionEnabled() const
+        explicit Expander(Environment environment = Environment::process()) : m_environment{ std::move(environment) }
         {
-            BOOL value{};
-            RegQueryReflectionKey(
-                m_keyHandle,    //hBase
-                &value          //bIsReflectionDisabled
-            );
-            return !static_cast<bool>(value);
         }
 
+        /**
+         * @brief Expand [text] into a buffer that is reused by the next call
+         */
+        std::wstring_view expand(std::wstring_view text)
+        {
+            m_buffer.clear();
+            append(m_buffer, text);
+            return m_buffer;
+        }
 
-        void flush() const
+        /**
+         * @brief Expand every string of [texts] into the one [arena]
+         * @return Views of the expanded strings, in the same order, valid while the arena is not modified
+         */
+        template<typename Strings>
+        std::vector<std::wstring_view> expandAll(Strings const& texts, std::wstring& arena)
         {
-            RegFlushKey(m_keyHandle);
+            std::vector<std::pair<size_t, size_t>> ranges;
+            for (auto const& text : texts)
+            {
+                auto const start = arena.size();
+                append(arena, std::wstring_view{ text });
+                ranges.emplace_back(start, arena.size() - start);
+            }
+            std::vector<std::wstring_view> result;
+            result.reserve(ranges.size());
+            for (auto const& [start, length] : ranges)
+                result.emplace_back(arena.data() + start, length);
+            return result;
         }
 
-        [[nodiscard]] auto getHandle() const
+        void clearCache()
         {
-            return m_keyHandle;
+            m_parsed.clear();
+            m_variables.clear();
         }
     };
 
+    inline std::wstring Value<Type::UnexpandedString>::expand(Expander& expander) const
+    {
+        return std::wstring{ expander.expand(m_value) };
+    }
+
+    inline Environment& Environment::load(Key const& key)
+    {
+        Expander expander{ custom([this](std::wstring_view name) { return get(name); }) };
+        std::wstring name(ValueNameMax + 1, 0);
+        for (DWORD index = 0;; ++index)
+        {
+            DWORD length = ValueNameMax + 1;
+            DWORD type{};
+            if (RegEnumValueW(key.getHandle(), index, &name[0], &length, 0, &type, nullptr, nullptr) != ERROR_SUCCESS)
+                break;
+            std::wstring valueName{ name.data(), length };
+            if (type == REG_SZ)
+                set(valueName, key.valueOf(valueName).as<Type::String>().get());
+            else if (type == REG_EXPAND_SZ)
+            {
+                expander.clearCache();  //see the variables set so far
+                set(valueName, key.valueOf(valueName).as<Type::UnexpandedString>().expand(expander));
+            }
+        }
+        return *this;
+    }
+
+    /**
+     * @brief A key shared by several owners, see Key::share()
+     */
+    using SharedKey = std::shared_ptr<Key const>;
+
     Key LocalMachine{ HKEY_LOCAL_MACHINE };
     Key ClassesRoot{ HKEY_CLASSES_ROOT };
     Key CurrentUser{ HKEY_CURRENT_USER };
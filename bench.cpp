@@ -0,0 +1,317 @@
+#include "Regeditpp.hpp"
+#include <chrono>
+#include <cstdio>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+
+using namespace RegeditPP;
+
+//Benchmarks on a tree generated under HKEY_CURRENT_USER\RegeditPPBench, which is removed afterwards
+
+template<typename Function>
+static double secondsOf(Function&& function)
+{
+    auto const start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(char const* name, double seconds, double count, char const* unit)
+{
+    std::printf("%-48s %10.3f ms %14.0f %s/s\n", name, seconds * 1000, count / seconds, unit);
+}
+
+//Counts the bytes written to it and throws them away
+class CountingBuffer : public std::streambuf
+{
+    size_t m_bytes{};
+protected:
+    std::streamsize xsputn(char const*, std::streamsize count) override
+    {
+        m_bytes += static_cast<size_t>(count);
+        return count;
+    }
+
+    int_type overflow(int_type c) override
+    {
+        ++m_bytes;
+        return traits_type::not_eof(c);
+    }
+public:
+    auto getBytes() const
+    {
+        return m_bytes;
+    }
+};
+
+static void createUninstallTree(Key const& root, int apps)
+{
+    auto uninstall = root.create(L"Uninstall");
+    for (auto i = 0; i < apps; ++i)
+    {
+        wchar_t name[32]{};
+        swprintf(name, std::size(name), L"App%05d", i);
+        auto app = uninstall.create(name);
+        app += Value<Type::String>(L"DisplayName", std::wstring{ L"Application, edition " } + name);
+        app += Value<Type::UnexpandedString>(L"InstallLocation", std::wstring{ L"%ProgramFiles%\\Vendor\\" } + name);
+        app += Value<Type::UnexpandedString>(L"UninstallString", std::wstring{ L"%SystemRoot%\\System32\\msiexec.exe /x " } + name);
+        app += Value<Type::Dword>(L"EstimatedSize", static_cast<DWORD>(i * 37));
+        app += Value<Type::Binary>(L"Signature", std::vector<BYTE>(64, static_cast<BYTE>(i)));
+    }
+}
+
+static std::wstring clsidName(int i)
+{
+    wchar_t name[64]{};
+    swprintf(name, std::size(name), L"{%08X-0000-0000-C000-000000000046}", i);
+    return name;
+}
+
+static void createClsidTree(Key const& root, int count)
+{
+    auto clsid = root.create(L"CLSID");
+    for (auto i = 0; i < count; ++i)
+        clsid.create(clsidName(i));
+}
+
+static void benchIndex(Key const& root, int count)
+{
+    auto const clsid = root[L"CLSID"];
+    std::vector<std::wstring> names;
+    for (auto i = 0; i < count; i += 7)
+        names.push_back(clsidName(i));
+
+    std::shared_ptr<SubKeyIndex const> index;
+    report("subkey index build", secondsOf([&] { index = clsid.subKeyIndex(); }), count, "subkeys");
+
+    size_t found{};
+    auto const indexSeconds = secondsOf([&]
+    {
+        for (auto const& name : names)
+            found += index->contains(name);
+    });
+    report("lookup with the subkey index", indexSeconds, static_cast<double>(names.size()), "lookups");
+
+    found = 0;
+    auto const cachedSeconds = secondsOf([&]
+    {
+        for (auto const& name : names)
+            found += clsid.hasSubKey(name);
+    });
+    report("hasSubKey() (cached index)", cachedSeconds, static_cast<double>(names.size()), "lookups");
+
+    found = 0;
+    auto const refreshedSeconds = secondsOf([&]
+    {
+        for (auto const& name : names)
+            found += clsid.refreshSubKeyIndex()->contains(name);
+    });
+    report("refreshSubKeyIndex() before each lookup", refreshedSeconds, static_cast<double>(names.size()), "lookups");
+
+    found = 0;
+    auto const openSeconds = secondsOf([&]
+    {
+        for (auto const& name : names)
+        {
+            HKEY child{};
+            if (RegOpenKeyExW(clsid.getHandle(), name.data(), 0, AccessRight::Read, &child) == ERROR_SUCCESS)
+            {
+                ++found;
+                RegCloseKey(child);
+            }
+        }
+    });
+    report("lookup by opening the subkey", openSeconds, static_cast<double>(names.size()), "lookups");
+
+    //a linear scan with RegEnumKeyExW is what positional enumeration offers
+    auto const scanned = (std::min)(names.size(), size_t{ 100 });
+    found = 0;
+    auto const scanSeconds = secondsOf([&]
+    {
+        std::wstring name(KayNameMax + 1, 0);
+        for (size_t i = 0; i < scanned; ++i)
+        {
+            for (DWORD index = 0;; ++index)
+            {
+                DWORD length = KayNameMax + 1;
+                if (RegEnumKeyExW(clsid.getHandle(), index, &name[0], &length, nullptr, nullptr, nullptr, nullptr) != ERROR_SUCCESS)
+                    break;
+                if (detail::compareIgnoreCase({ name.data(), length }, names[i]) == 0)
+                {
+                    ++found;
+                    break;
+                }
+            }
+        }
+    });
+    report("lookup by enumerating the subkeys", scanSeconds, static_cast<double>(scanned), "lookups");
+
+    size_t prefixed{};
+    auto const prefixSeconds = secondsOf([&]
+    {
+        for (auto i = 0; i < 256; ++i)
+        {
+            wchar_t prefix[8]{};
+            swprintf(prefix, std::size(prefix), L"{0000%02X", i);
+            prefixed += index->withPrefix(prefix).size();
+        }
+    });
+    report("prefix ranges with the subkey index", prefixSeconds, 256, "ranges");
+    std::printf("%zu subkeys in the prefix ranges\n", prefixed);
+}
+
+static void benchSnapshot(Key const& root)
+{
+    auto const uninstall = root[L"Uninstall"];
+    for (auto const options : { SnapshotOptions{ false, false }, SnapshotOptions{ true, false }, SnapshotOptions{ true, true } })
+    {
+        SnapshotStats stats{};
+        std::vector<BYTE> image;
+        auto const seconds = secondsOf([&] { image = SnapshotBuilder::build(uninstall, 0, options, &stats); });
+        std::printf("snapshot (names %s, data %s): %zu of %zu name bytes, %zu of %zu data bytes, image %zu bytes\n",
+            options.internNames ? "interned" : "plain", options.dedupData ? "deduped" : "plain",
+            stats.storedNameBytes, stats.nameBytes, stats.storedDataBytes, stats.dataBytes, image.size());
+        report("snapshot build", seconds, static_cast<double>(stats.values), "values");
+    }
+}
+
+static void benchArchive(Key const& root, int apps)
+{
+    auto const uninstall = root[L"Uninstall"];
+    auto const raw = SnapshotBuilder::build(uninstall, 0, { false, false }).size();
+    std::vector<std::wstring> paths;
+    for (auto i = 0; i < apps; i += 13)
+    {
+        wchar_t name[32]{};
+        swprintf(name, std::size(name), L"App%05d", (i * 7919) % apps);    //scattered over the blocks
+        paths.push_back(name);
+    }
+
+    for (auto const blockSize : { size_t{ 4 * 1024 }, ArchiveWriter::DefaultBlockSize, size_t{ 64 * 1024 } })
+    {
+        std::stringstream stream;
+        size_t blocks{};
+        auto const writeSeconds = secondsOf([&] { blocks = ArchiveWriter::write(uninstall, stream, blockSize); });
+        auto const bytes = stream.str();
+        std::printf("archive with %zu KiB blocks: %zu blocks, %zu bytes (%.1f%% of a %zu byte image)\n",
+            blockSize / 1024, blocks, bytes.size(), 100.0 * bytes.size() / raw, raw);
+        report("archive write", writeSeconds, static_cast<double>(raw), "bytes");
+
+        Archive const archive{ std::vector<BYTE>(bytes.begin(), bytes.end()) };
+        size_t found{};
+        auto const memorySeconds = secondsOf([&]
+        {
+            for (auto const& path : paths)
+                found += archive.find(path).has_value();
+        });
+        report("archive lookup (in memory)", memorySeconds, static_cast<double>(paths.size()), "lookups");
+
+        Archive const streamed{ std::make_unique<std::istringstream>(bytes) };
+        auto const streamSeconds = secondsOf([&]
+        {
+            for (auto const& path : paths)
+                found += streamed.find(path).has_value();
+        });
+        report("archive lookup (from a stream)", streamSeconds, static_cast<double>(paths.size()), "lookups");
+        std::printf("%.2f us per lookup in memory, %.2f us from a stream, %zu found\n",
+            memorySeconds * 1e6 / paths.size(), streamSeconds * 1e6 / paths.size(), found);
+    }
+}
+
+static void benchExpansion(Key const& root)
+{
+    for (auto const& [name, value] : { std::pair{ L"ProgramFiles", L"C:\\Program Files" }, std::pair{ L"SystemRoot", L"C:\\Windows" } })
+    {
+        if (GetEnvironmentVariableW(name, nullptr, 0) == 0)
+            SetEnvironmentVariableW(name, value);
+    }
+
+    std::vector<Value<Type::UnexpandedString>> values;
+    root.query(L"Uninstall\\*", L"*", [&values](std::wstring_view, Key::ValueVariant&& value)
+    {
+        if (auto const unexpanded = std::get_if<Value<Type::UnexpandedString>>(&value))
+            values.push_back(std::move(*unexpanded));
+    });
+
+    size_t characters{};
+    auto const perValueSeconds = secondsOf([&]
+    {
+        for (auto const& value : values)
+            characters += value.expand().size();
+    });
+    report("expand() per value", perValueSeconds, static_cast<double>(values.size()), "values");
+
+    Expander expander;
+    auto const expanderSeconds = secondsOf([&]
+    {
+        for (auto const& value : values)
+            characters += expander.expand(value.get()).size();
+    });
+    report("Expander::expand()", expanderSeconds, static_cast<double>(values.size()), "values");
+
+    std::vector<std::wstring_view> texts;
+    for (auto const& value : values)
+        texts.push_back(value.get());
+    std::wstring arena;
+    auto const batchSeconds = secondsOf([&]
+    {
+        characters += expander.expandAll(texts, arena).size();
+    });
+    report("Expander::expandAll() into one arena", batchSeconds, static_cast<double>(values.size()), "values");
+    std::printf("%zu characters expanded\n", characters);
+}
+
+static void benchExport(Key const& root)
+{
+    auto const uninstall = root[L"Uninstall"];
+    for (auto const format : { ExportFormat::JsonLines, ExportFormat::Csv })
+    {
+        auto const formatName = format == ExportFormat::JsonLines ? "JSON Lines" : "CSV";
+        CountingBuffer buffer;
+        std::ostream out{ &buffer };
+        size_t records{};
+        auto const seconds = secondsOf([&]
+        {
+            Exporter exporter{ out, format };
+            exporter.write(uninstall, L"Uninstall");
+            exporter.flush();
+            records = exporter.getRecordCount();
+        });
+        std::printf("%s: %zu records, %zu bytes\n", formatName, records, buffer.getBytes());
+        report("export (records)", seconds, static_cast<double>(records), "records");
+        report("export (bytes)", seconds, static_cast<double>(buffer.getBytes()), "bytes");
+
+        size_t shardedRecords{};
+        auto const shardedSeconds = secondsOf([&]
+        {
+            shardedRecords = Exporter::writeSharded(uninstall, format, [](std::wstring_view)
+            {
+                struct DiscardingStream : std::ostream
+                {
+                    CountingBuffer buffer;
+                    DiscardingStream() : std::ostream{ &buffer } {}
+                };
+                return std::unique_ptr<std::ostream>{ std::make_unique<DiscardingStream>() };
+            });
+        });
+        report("export sharded by subtree", shardedSeconds, static_cast<double>(shardedRecords), "records");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    auto const apps = argc > 1 ? std::atoi(argv[1]) : 5000;
+    auto root = CurrentUser.create(L"RegeditPPBench");
+    std::printf("Generating %d applications and %d CLSIDs\n", apps, apps * 4);
+    createUninstallTree(root, apps);
+    createClsidTree(root, apps * 4);
+
+    benchExport(root);
+    benchIndex(root, apps * 4);
+    benchSnapshot(root);
+    benchArchive(root, apps);
+    benchExpansion(root);
+
+    CurrentUser.removeTree(L"RegeditPPBench");
+}
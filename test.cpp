@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
 #include <array>
 #include "Regeditpp.hpp"
+#include <sddl.h>
 #include <initializer_list>
+#include <sstream>
+#include <map>
 
 using namespace RegeditPP;
 
@@ -17,6 +20,77 @@ TEST(Read, ReadNonExistKey)
 }
 
 
+//Ownership of handles
+TEST(Ownership, MoveAndShare)
+{
+    auto key = CurrentUser[L"test"];
+    EXPECT_TRUE(key.ownsHandle());
+    auto const handle = key.getHandle();
+
+    auto moved = std::move(key);
+    EXPECT_FALSE(key);
+    EXPECT_EQ(moved.getHandle(), handle);
+
+    auto const clone = moved.clone();
+    EXPECT_NE(clone.getHandle(), handle);
+
+    SharedKey const shared = std::move(moved).share();
+    auto const copy = shared;
+    EXPECT_EQ(copy->getHandle(), handle);
+    EXPECT_FALSE(CurrentUser.ownsHandle());
+}
+TEST(Ownership, StableHandleCountUnderParallelOpenAndClose)
+{
+    auto const countHandles = []
+    {
+        DWORD count{};
+        GetProcessHandleCount(GetCurrentProcess(), &count);
+        return count;
+    };
+    auto const parent = CurrentUser[L"test"];
+    auto const before = countHandles();
+    std::vector<std::thread> threads;
+    for (auto i = 0; i < 8; ++i)
+    {
+        threads.emplace_back([&parent]
+        {
+            for (auto j = 0; j < 1000; ++j)
+            {
+                //concurrent reads through the same key
+                auto key = parent[L"NewTestKey"];
+                auto shared = std::move(key).share();
+                EXPECT_EQ(shared->valueOf(L"dwordValue").as<Type::Dword>().get(), 0x4d2);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(countHandles(), before);
+}
+
+//Index of subkey names
+TEST(Index, LookupAndPrefix)
+{
+    auto key = CurrentUser[L"test"][L"Index"];
+    auto const index = key.subKeyIndex();
+    EXPECT_EQ(index->size(), 2000);
+    EXPECT_EQ(index->find(L"{000007CF-0000-0000-C000-000000000046}"), std::wstring_view{ L"{000007cf-0000-0000-C000-000000000046}" });
+    EXPECT_FALSE(index->contains(L"{000007D0-0000-0000-C000-000000000046}"));
+    EXPECT_EQ(index->withPrefix(L"{000001").size(), 256);
+    EXPECT_TRUE(index->withPrefix(L"x").empty());
+
+    EXPECT_EQ(key.refreshSubKeyIndex(), index);     //kept while the key is unchanged
+    key.create(L"{000007D0-0000-0000-C000-000000000046}");
+    EXPECT_FALSE(key.hasSubKey(L"{000007D0-0000-0000-C000-000000000046}"));   //the cached index is not checked
+    EXPECT_NE(key.refreshSubKeyIndex(), index);
+    EXPECT_TRUE(key.hasSubKey(L"{000007D0-0000-0000-C000-000000000046}"));
+    key.create(L"{000007D1-0000-0000-C000-000000000046}");  //most likely within the same tick of the last write time
+    key.refreshSubKeyIndex();
+    EXPECT_TRUE(key.hasSubKey(L"{000007D1-0000-0000-C000-000000000046}"));
+    key.remove(L"{000007D0-0000-0000-C000-000000000046}");
+    key.remove(L"{000007D1-0000-0000-C000-000000000046}");
+}
+
 //Creating a key
 TEST(Create, CreateNewKey)
 {
@@ -67,6 +141,47 @@ TEST(Read, UnexpandedStringValue)
     auto&& originalString = value.get();
     auto&& expandedString = value.expand();
     EXPECT_NE(originalString, expandedString);  //Can't really test this
+
+    Expander expander;
+    EXPECT_EQ(value.expand(expander), expandedString);
+}
+TEST(Read, ExpanderWithEnvironment)
+{
+    auto environment = Environment{}.set(L"SystemRoot", L"C:\\Windows").set(L"AppName", L"Foo");
+    Expander expander{ environment };
+    EXPECT_EQ(expander.expand(L"%systemroot%\\%APPNAME%.exe"), L"C:\\Windows\\Foo.exe");
+    EXPECT_EQ(expander.expand(L"%Undefined%\\100%"), L"%Undefined%\\100%");
+
+    std::wstring arena;
+    std::vector<std::wstring> const texts{ L"%AppName%", L"plain", L"%SystemRoot%\\%AppName%" };
+    auto const expanded = expander.expandAll(texts, arena);
+    ASSERT_EQ(expanded.size(), 3);
+    EXPECT_EQ(expanded[0], L"Foo");
+    EXPECT_EQ(expanded[1], L"plain");
+    EXPECT_EQ(expanded[2], L"C:\\Windows\\Foo");
+
+    //the same as ExpandEnvironmentStringsW, including the '%' around undefined and empty names
+    SetEnvironmentVariableW(L"REGEDITPP_FOO", L"foo");
+    SetEnvironmentVariableW(L"REGEDITPP_EMPTY", L"");
+    Expander processExpander;
+    for (auto text : { L"%NOTDEF%REGEDITPP_FOO%", L"50%%REGEDITPP_FOO%", L"%REGEDITPP_FOO%%REGEDITPP_FOO%", L"%%",
+        L"%", L"100%", L"a%b%c", L"%REGEDITPP_FOO", L"%%REGEDITPP_FOO%%", L"%NOTDEF%%REGEDITPP_FOO%x%",
+        L"[%REGEDITPP_EMPTY%]", L"%REGEDITPP_EMPTY%REGEDITPP_FOO%" })
+    {
+        auto const length = ExpandEnvironmentStringsW(text, nullptr, 0);
+        std::wstring expected(length, 0);
+        ExpandEnvironmentStringsW(text, &expected[0], length);
+        expected.resize(length - 1);
+        EXPECT_EQ(processExpander.expand(text), expected) << text;
+    }
+    EXPECT_EQ(processExpander.expand(L"%NOTDEF%REGEDITPP_FOO%"), L"%NOTDEFfoo");
+    EXPECT_EQ(processExpander.expand(L"50%%REGEDITPP_FOO%"), L"50%foo");
+    EXPECT_EQ(processExpander.expand(L"[%REGEDITPP_EMPTY%]"), L"[]");     //defined, but empty
+    SetEnvironmentVariableW(L"REGEDITPP_FOO", nullptr);
+    SetEnvironmentVariableW(L"REGEDITPP_EMPTY", nullptr);
+
+    auto const captured = Environment::capture();
+    EXPECT_EQ(captured.get(L"PATH"), Environment::process().get(L"PATH"));
 }
 TEST(Read, MultiStringValue)
 {
@@ -80,6 +195,52 @@ TEST(Read, MultiStringValue)
     }
 }
 
+//Stream a value in chunks
+TEST(Stream, WriteAndReadInChunks)
+{
+    auto key = CurrentUser[L"test"][L"NewTestKey"];
+    size_t generated = 0;
+    key.writeValue(L"largeBinaryValue", Type::Binary, [&generated](BYTE* chunk, size_t capacity)
+    {
+        auto const bytes = (std::min)(capacity, 1000000 - generated);
+        for (size_t i = 0; i < bytes; ++i)
+            chunk[i] = static_cast<BYTE>((generated + i) % 251);
+        generated += bytes;
+        return bytes;
+    }, 4096, 1000000);
+
+    auto reader = key.openValueReader(L"largeBinaryValue");
+    EXPECT_EQ(reader.getSize(), 1000000);
+    EXPECT_EQ(reader.getType(), Type::Binary);
+    std::array<BYTE, 777> buffer{};
+    size_t offset = 0;
+    bool matches = true;
+    for (size_t bytes; (bytes = reader.read(buffer.data(), buffer.size())) != 0; offset += bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+            matches &= (buffer[i] == static_cast<BYTE>((offset + i) % 251));
+    }
+    EXPECT_TRUE(matches);
+    EXPECT_EQ(offset, 1000000);
+
+    //a size hint that is too small only makes the buffer grow
+    auto writer = key.openValueWriter(L"largeBinaryValue", Type::Binary, 10);
+    writer.write("header", 6);
+    auto remaining = 100000;
+    writer.generate([&remaining](BYTE* chunk, size_t capacity)
+    {
+        auto const bytes = (std::min)(capacity, static_cast<size_t>(remaining));
+        std::fill_n(chunk, bytes, BYTE{ 0x5a });
+        remaining -= static_cast<int>(bytes);
+        return bytes;
+    }, 1000);
+    EXPECT_EQ(writer.getSize(), 100006);
+    writer.commit();
+    auto const written = key.openValueReader(L"largeBinaryValue");
+    EXPECT_EQ(written.getSize(), 100006);
+    key -= L"largeBinaryValue";
+}
+
 //Delete a value
 auto FindValueImpl(HKEY key, std::wstring_view name)
 {
@@ -156,6 +317,310 @@ TEST(Enum, EnumEmpty)
     EXPECT_EQ(key.begin(), key.end());
 }
 
+TEST(Enum, EnumSubKeyIsOpened)
+{
+    auto key = CurrentUser[L"test"][L"EnumKeys"];
+    auto const child = key[DWORD{ 0 }];
+    EXPECT_TRUE(std::get<Key>(child));
+    EXPECT_EQ(std::get<Key>(child).getNumChild().subKeys, 0);
+    auto const clone = std::get<Key>(child).clone();     //reopened read-only, like the original
+    EXPECT_TRUE(clone);
+    EXPECT_EQ(clone.getAccess(), AccessRight::Read);
+}
+
+//Metadata of subkeys
+TEST(Children, NamesAndCounts)
+{
+    auto key = CurrentUser[L"test"][L"Query"];
+    auto const children = key.children(true);
+    ASSERT_EQ(children.size(), 3);
+    EXPECT_EQ(children[0].name, L"App1");
+    EXPECT_EQ(children[0].subKeys, 1);
+    EXPECT_EQ(children[2].name, L"Other");
+    EXPECT_EQ(key.children()[2].subKeys, 0);    //not opened
+}
+TEST(Children, TreeSize)
+{
+    auto const size = CurrentUser[L"test"][L"Query"].getTreeSize();
+    EXPECT_EQ(size.keys, 10);
+    EXPECT_EQ(size.values, 4);
+    EXPECT_GT(size.dataBytes, 0);
+}
+
+//Snapshot images
+TEST(Snapshot, Lookup)
+{
+    auto const image = SnapshotBuilder::build(CurrentUser[L"test"][L"Query"], 7);
+    SnapshotKey const root{ image.data(), image.size() };
+    EXPECT_EQ(root.getGeneration(), 7);
+    EXPECT_EQ(root.getNumChild().subKeys, 3);
+    EXPECT_EQ(root[L"app1\\UNINSTALL\\y"].valueOf(L"displayname").getString(), L"App1\\Uninstall\\Y");
+    EXPECT_EQ(root[L"Other\\Data"].valueOf(L"DisplayName").as<Type::String>().get(), L"Other\\Data");
+    EXPECT_FALSE(root.find(L"App1\\Missing"));
+    EXPECT_FALSE(root[L"App2"].findValue(L"DisplayName"));
+
+    EXPECT_THROW((SnapshotKey{ image.data(), image.size() / 2 }), std::runtime_error);    //truncated
+    auto corrupted = image;
+    uint32_t const keyCount = 0x10000000;
+    std::memcpy(corrupted.data() + offsetof(detail::SnapshotHeader, keyCount), &keyCount, sizeof(keyCount));
+    EXPECT_THROW((SnapshotKey{ corrupted.data(), corrupted.size() }), std::runtime_error);
+}
+TEST(Snapshot, PublishGenerations)
+{
+    ConfigServer server{ L"RegeditPPTest", CurrentUser[L"test"][L"Query"] };
+    ConfigClient client{ L"RegeditPPTest" };
+    auto const first = client.current();
+    EXPECT_EQ(first->getGeneration(), 1);
+    EXPECT_EQ(client.current(), first);
+    EXPECT_FALSE(first->root()[L"App2"].findValue(L"Published"));
+
+    auto key = CurrentUser[L"test"][L"Query"][L"App2"];
+    key += Value<Type::Dword>(L"Published", 2);
+    server.publish();
+    auto const second = client.current();
+    EXPECT_EQ(second->getGeneration(), 2);
+    EXPECT_EQ(second->root()[L"App2"].valueOf(L"Published").as<Type::Dword>().get(), 2);
+    EXPECT_FALSE(first->root()[L"App2"].findValue(L"Published"));   //old generation is unchanged
+    key -= L"Published";
+}
+
+TEST(Snapshot, InternedNamesAndDedupedData)
+{
+    auto const key = CurrentUser[L"test"][L"Interning"];
+    SnapshotStats plain{};
+    SnapshotStats interned{};
+    auto const plainImage = SnapshotBuilder::build(key, 0, { false, false }, &plain);
+    auto const image = SnapshotBuilder::build(key, 0, { true, true }, &interned);
+    RecordProperty("plainNameBytes", static_cast<int>(plain.storedNameBytes));
+    RecordProperty("internedNameBytes", static_cast<int>(interned.storedNameBytes));
+    RecordProperty("plainDataBytes", static_cast<int>(plain.storedDataBytes));
+    RecordProperty("dedupedDataBytes", static_cast<int>(interned.storedDataBytes));
+    RecordProperty("plainImageBytes", static_cast<int>(plainImage.size()));
+    RecordProperty("imageBytes", static_cast<int>(image.size()));
+
+    EXPECT_EQ(interned.names, 200 * 3 + 200);
+    EXPECT_EQ(interned.uniqueNames, 200 + 3);
+    EXPECT_GE(plain.storedNameBytes, 3 * interned.storedNameBytes);
+    EXPECT_GE(plain.storedDataBytes, 3 * interned.storedDataBytes);
+
+    SnapshotKey const root{ image.data(), image.size() };
+    EXPECT_EQ(root[L"{00000001}"].valueOf(L"ThreadingModel").getNameId(), root[L"{00000002}"].valueOf(L"ThreadingModel").getNameId());
+    EXPECT_EQ(root[L"{00000002}"].valueOf(L"ThreadingModel").getString(), L"Both");
+
+    NamePool pool;
+    auto const id = pool.intern(L"ThreadingModel");
+    auto const otherCase = pool.intern(L"threadingMODEL");
+    EXPECT_NE(otherCase, id);
+    EXPECT_EQ(pool.view(otherCase), L"threadingMODEL");
+    EXPECT_EQ(pool.getNameId(otherCase), id);
+    EXPECT_EQ(pool.findNameId(L"THREADINGMODEL"), id);
+    EXPECT_FALSE(pool.find(L"THREADINGMODEL"));
+    EXPECT_EQ(pool.intern(L"ThreadingModel"), id);
+    EXPECT_NE(pool.getNameId(pool.intern(L"ThreadingModel2")), id);
+}
+TEST(Snapshot, NamesKeepTheirCase)
+{
+    auto const key = CurrentUser[L"test"].create(L"Casing");
+    key.create(L"First").create(L"Sub") += Value<Type::Dword>(L"DisplayName", 1);
+    key.create(L"Second").create(L"SUB") += Value<Type::Dword>(L"displayname", 2);
+    for (auto const internNames : { true, false })
+    {
+        auto const image = SnapshotBuilder::build(key, 0, { internNames, false });
+        SnapshotKey const root{ image.data(), image.size() };
+        auto const first = root[L"First\\sub"];
+        auto const second = root[L"second\\sub"];
+        EXPECT_EQ(first.getName(), L"Sub");
+        EXPECT_EQ(second.getName(), L"SUB");
+        EXPECT_EQ(first.getNameId(), second.getNameId());
+        EXPECT_EQ(first.valueOf(L"DISPLAYNAME").getName(), L"DisplayName");
+        EXPECT_EQ(second.valueOf(L"DISPLAYNAME").getName(), L"displayname");
+        EXPECT_EQ(first.valueOf(L"DisplayName").getNameId(), second.valueOf(L"DisplayName").getNameId());
+        EXPECT_NE(first.getNameId(), first.valueOf(L"DisplayName").getNameId());
+    }
+    CurrentUser[L"test"].removeTree(L"Casing");
+}
+
+//Compressed archive
+TEST(Archive, CompressionRoundTrip)
+{
+    std::vector<BYTE> data(100000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<BYTE>((i % 1000 < 500) ? i % 7 : (i * 2654435761u) >> 13);
+    auto const compressed = detail::lz4Compress(data.data(), data.size());
+    EXPECT_LT(compressed.size(), data.size());
+    std::vector<BYTE> decompressed(data.size());
+    detail::lz4Decompress(compressed.data(), compressed.size(), decompressed.data(), decompressed.size());
+    EXPECT_EQ(decompressed, data);
+}
+TEST(Archive, RandomAccessByPath)
+{
+    std::stringstream stream;
+    auto const blocks = ArchiveWriter::write(CurrentUser[L"test"][L"Interning"], stream, 1024);
+    EXPECT_GT(blocks, 10);
+    auto const bytes = stream.str();
+    Archive const archive{ std::vector<BYTE>(bytes.begin(), bytes.end()) };
+    EXPECT_EQ(archive.getBlockCount(), blocks);
+
+    auto const root = archive.find(L"");
+    ASSERT_TRUE(root);
+    EXPECT_TRUE(root->values.empty());
+    for (auto i : { 0, 57, 131, 199 })
+    {
+        wchar_t name[16]{};
+        swprintf(name, std::size(name), L"{%08X}", i);
+        auto const key = archive.find(name);
+        ASSERT_TRUE(key);
+        ASSERT_EQ(key->values.size(), 3);
+        auto const threadingModel = std::find_if(key->values.begin(), key->values.end(), [](auto const& value) { return value.name == L"ThreadingModel"; });
+        ASSERT_NE(threadingModel, key->values.end());
+        EXPECT_EQ(threadingModel->type, Type::String);
+        EXPECT_EQ(threadingModel->data.size(), 4 * sizeof(wchar_t));    //"Both", written without a null terminator
+    }
+    EXPECT_FALSE(archive.find(L"{00000200}"));
+    EXPECT_FALSE(archive.find(L"{00000001}\\missing"));
+
+    //read from a stream, which is only read for the index and the blocks looked up
+    Archive const streamed{ std::make_unique<std::istringstream>(bytes) };
+    EXPECT_EQ(streamed.getBlockCount(), blocks);
+    auto const key = streamed.find(L"{0000007b}");
+    ASSERT_TRUE(key);
+    EXPECT_EQ(key->path, L"{0000007b}");
+    EXPECT_EQ(key->values.size(), 3);
+    EXPECT_FALSE(streamed.find(L"{00000200}"));
+
+    EXPECT_THROW(Archive{ std::vector<BYTE>(bytes.begin(), bytes.end() - 1) }, std::runtime_error);     //truncated
+}
+TEST(Archive, WriteToUnseekableStream)
+{
+    //a stream buffer that only appends, like a pipe
+    struct AppendingBuffer : std::streambuf
+    {
+        std::string bytes;
+    protected:
+        std::streamsize xsputn(char const* data, std::streamsize count) override
+        {
+            bytes.append(data, static_cast<size_t>(count));
+            return count;
+        }
+        int_type overflow(int_type c) override
+        {
+            bytes += traits_type::to_char_type(c);
+            return traits_type::not_eof(c);
+        }
+    } buffer;
+    std::ostream out{ &buffer };
+    ArchiveWriter::write(CurrentUser[L"test"][L"Query"], out, 64);
+    EXPECT_TRUE(out);
+
+    std::stringstream seekable;
+    ArchiveWriter::write(CurrentUser[L"test"][L"Query"], seekable, 64);
+    EXPECT_EQ(buffer.bytes, seekable.str());
+
+    Archive const archive{ std::vector<BYTE>(buffer.bytes.begin(), buffer.bytes.end()) };
+    EXPECT_TRUE(archive.find(L"app2\\uninstall\\x"));
+}
+
+//Remove trees
+TEST(Remove, RemoveTreeWithProgress)
+{
+    auto const key = CurrentUser[L"test"];
+    auto stale = key.create(L"Stale");
+    for (auto a : { L"a", L"b", L"c", L"d", L"e" })
+        for (auto b : { L"a", L"b", L"c", L"d", L"e" })
+            for (auto c : { L"a", L"b", L"c", L"d", L"e" })
+                stale.create(std::wstring{ a } + L"\\" + b + L"\\" + c) += Value<Type::Dword>(L"value", 1);
+
+    size_t lastProgress = 0;
+    std::atomic<bool> cancel{};
+    RemoveOptions options;
+    options.progress = [&lastProgress, &cancel](size_t removed)
+    {
+        lastProgress = removed;
+        cancel = removed == 1 + 5 + 25 + 125;   //after the last key, so nothing is cancelled
+    };
+    options.cancel = &cancel;
+    auto const result = key.removeTree(L"Stale", options);
+    EXPECT_EQ(result.removed, 1 + 5 + 25 + 125);
+    EXPECT_EQ(lastProgress, result.removed);
+    EXPECT_TRUE(result.errors.empty());
+    EXPECT_FALSE(result.cancelled);
+    EXPECT_ANY_THROW(key[L"Stale"]);
+
+    auto const missing = key.removeTree(L"Stale");
+    ASSERT_EQ(missing.errors.size(), 1);
+    EXPECT_EQ(missing.errors[0].second, ERROR_FILE_NOT_FOUND);
+}
+TEST(Remove, PruneAndCancel)
+{
+    auto prune = CurrentUser[L"test"].create(L"Prune");
+    for (auto path : { L"cache1\\x", L"Cache2\\y", L"keep\\cache3", L"keep\\data" })
+        prune.create(path);
+
+    std::atomic<bool> cancel{ true };
+    RemoveOptions options;
+    options.cancel = &cancel;
+    auto const cancelled = prune.prune(RemoveFilter::nameMatches(L"cache*"), options);
+    EXPECT_TRUE(cancelled.cancelled);
+    EXPECT_EQ(cancelled.removed, 0);
+
+    std::atomic<size_t> calls{};    //the predicate is called concurrently
+    auto const result = prune.prune([&calls, filter = RemoveFilter::nameMatches(L"cache*")](std::wstring_view path, Key::ChildInfo const& info)
+    {
+        ++calls;
+        return filter(path, info);
+    });
+    EXPECT_FALSE(result.cancelled);
+    EXPECT_EQ(calls, 5);    //cache1, Cache2, keep, keep\cache3 and keep\data
+    EXPECT_EQ(result.removed, 5);
+    EXPECT_TRUE(prune.hasSubKey(L"keep"));
+    EXPECT_FALSE(prune.hasSubKey(L"cache1"));
+    EXPECT_EQ(prune[L"keep"].children().size(), 1);
+    CurrentUser[L"test"].removeTree(L"Prune");
+}
+
+//Create a registry symbolic link [name] under [parent] to [target], a path relative to HKEY_CURRENT_USER
+static void CreateLink(Key const& parent, std::wstring const& name, std::wstring const& target)
+{
+    HANDLE token{};
+    ASSERT_TRUE(OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token));
+    DWORD size{};
+    GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+    std::vector<BYTE> user(size);
+    ASSERT_TRUE(GetTokenInformation(token, TokenUser, user.data(), size, &size));
+    CloseHandle(token);
+    LPWSTR sid{};
+    ASSERT_TRUE(ConvertSidToStringSidW(reinterpret_cast<TOKEN_USER const*>(user.data())->User.Sid, &sid));
+    auto const path = std::wstring{ L"\\REGISTRY\\USER\\" } + sid + L"\\" + target;
+    LocalFree(sid);
+
+    HKEY link{};
+    ASSERT_EQ(RegCreateKeyExW(parent.getHandle(), name.data(), 0, nullptr, REG_OPTION_VOLATILE | REG_OPTION_CREATE_LINK,
+        KEY_ALL_ACCESS | KEY_CREATE_LINK, nullptr, &link, nullptr), ERROR_SUCCESS);
+    EXPECT_EQ(RegSetValueExW(link, L"SymbolicLinkValue", 0, REG_LINK,
+        reinterpret_cast<BYTE const*>(path.data()), static_cast<DWORD>(path.size() * sizeof(wchar_t))), ERROR_SUCCESS);  //no null terminator
+    RegCloseKey(link);
+}
+TEST(Remove, LinksAreRemovedButNotFollowed)
+{
+    auto const key = CurrentUser[L"test"];
+    key.create(L"LinkTarget\\cache\\x");
+    auto tree = key.create(L"LinkTree");
+    tree.create(L"Plain");
+    CreateLink(tree, L"Link", L"test\\LinkTarget");
+    ASSERT_TRUE(tree[L"Link"].hasSubKey(L"cache"));     //opening a link follows it
+
+    auto const pruned = tree.prune(RemoveFilter::nameMatches(L"cache"));   //the link is kept, and not searched
+    EXPECT_EQ(pruned.removed, 0);
+    EXPECT_TRUE(pruned.errors.empty());
+
+    auto const result = key.removeTree(L"LinkTree");
+    EXPECT_EQ(result.removed, 3);   //LinkTree, Plain and the link itself
+    EXPECT_TRUE(result.errors.empty());
+    EXPECT_ANY_THROW(key[L"LinkTree"]);
+    EXPECT_NO_THROW(key[L"LinkTarget\\cache\\x"]);
+    key.removeTree(L"LinkTarget");
+}
+
 //Rename key
 TEST(Rename, RenameKey)
 {
@@ -172,6 +637,74 @@ TEST(Additional, SplitString)
     EXPECT_EQ(splitResult[1], L"string");
 }
 
+//Query with patterns
+TEST(Query, WildcardPath)
+{
+    auto const result = CurrentUser[L"test"][L"Query"].query(L"*\\Uninstall\\*", L"DisplayName");
+    std::set<std::wstring> paths;
+    for (auto const& [path, value] : result)
+    {
+        paths.insert(path);
+        EXPECT_EQ(std::get<Value<Type::String>>(value).getName(), L"DisplayName");
+    }
+    EXPECT_EQ(paths, (std::set<std::wstring>{ L"App1\\Uninstall\\X", L"App1\\Uninstall\\Y", L"App2\\Uninstall\\X" }));
+}
+TEST(Query, RecursiveAndCharacterClass)
+{
+    auto const key = CurrentUser[L"test"][L"Query"];
+    EXPECT_EQ(key.query(L"**", L"DisplayName").size(), 4);
+    EXPECT_EQ(key.query(L"App[12]\\**\\[!x]").size(), 1);
+    std::set<std::wstring> paths;
+    for (auto const& [path, value] : key.query(L"app?\\uninstall\\x", L"*Name"))
+        paths.insert(path);
+    EXPECT_EQ(paths, (std::set<std::wstring>{ L"App1\\uninstall\\x", L"App2\\uninstall\\x" }));    //literal segments keep the spelling of the pattern
+    EXPECT_TRUE(key.query(L"Missing\\Uninstall").empty());
+}
+TEST(Query, NonAsciiNamesIgnoreCase)
+{
+    auto const key = CurrentUser[L"test"].create(L"Ärger");
+    key.create(L"Öl") += Value<Type::Dword>(L"DisplayName", 1);
+    EXPECT_EQ(CurrentUser[L"test"].query(L"ä*\\ö?", L"displayname").size(), 1);
+    EXPECT_TRUE(key.hasSubKey(L"öL"));
+    CurrentUser[L"test"].removeTree(L"Ärger");
+}
+
+//Export
+TEST(Export, JsonLines)
+{
+    std::ostringstream out;
+    Exporter exporter{ out, ExportFormat::JsonLines };
+    exporter.write(CurrentUser[L"test"][L"NewTestKey"], L"test\\NewTestKey");
+    exporter.flush();
+    EXPECT_EQ(exporter.getRecordCount(), 6);
+    auto const text = out.str();
+    EXPECT_EQ(std::count(text.begin(), text.end(), '\n'), 6);
+    EXPECT_NE(text.find(R"({"path":"test\\NewTestKey","name":"dwordValue","type":"REG_DWORD","size":4,"data":1234})"), std::string::npos);
+    EXPECT_NE(text.find(R"("type":"REG_BINARY","size":4,"data":"01020304")"), std::string::npos);
+    EXPECT_NE(text.find(R"("data":["multi","string"])"), std::string::npos);
+}
+TEST(Export, CsvSharded)
+{
+    auto csv = CurrentUser[L"test"].create(L"Csv");
+    csv += Value<Type::String>(L"quoted", std::wstring{ L"say \"hi\", then leave" });
+    wchar_t const lines[] = L"first\0second\0";
+    csv.create(L"sub") += Value<Type::MultiString>(L"lines", std::wstring{ std::begin(lines), std::end(lines) });
+    csv.create(L"other") += Value<Type::Dword>(L"number", 7);
+
+    std::map<std::wstring, std::stringbuf> shards;  //outlive the streams, which writeSharded destroys
+    auto const records = Exporter::writeSharded(csv, ExportFormat::Csv, [&](std::wstring_view subtree)
+    {
+        return std::make_unique<std::ostream>(&shards[std::wstring{ subtree }]);     //calls are serialized
+    });
+    EXPECT_EQ(records, 3);
+    ASSERT_EQ(shards.size(), 3);    //the key itself and 2 subkeys
+    auto const size = [](size_t characters) { return std::to_string(characters * sizeof(wchar_t)); };
+    EXPECT_EQ(shards[L""].str(), "path,name,type,size,data\n,quoted,REG_SZ," + size(20) + ",\"say \"\"hi\"\", then leave\"\n");
+    EXPECT_EQ(shards[L"sub"].str(), "path,name,type,size,data\nsub,lines,REG_MULTI_SZ," + size(14) + ",\"first\nsecond\"\n");
+    EXPECT_EQ(shards[L"other"].str(), "path,name,type,size,data\nother,number,REG_DWORD,4,7\n");
+    CurrentUser[L"test"].removeTree(L"Csv");
+}
+
 static void CreateTestingEnvironment()
 {
     auto testKey = CurrentUser.create(L"test");
@@ -204,6 +737,37 @@ static void CreateTestingEnvironment()
     }
 
     auto emptySubKey = testKey.create(L"empty");
+
+    {
+        //the same value names and data repeated in many keys
+        auto interningSubKey = testKey.create(L"Interning");
+        for (auto i = 0; i < 200; ++i)
+        {
+            wchar_t name[16]{};
+            swprintf(name, std::size(name), L"{%08x}", i);
+            auto clsid = interningSubKey.create(name);
+            clsid += Value<Type::String>(L"InprocServer32", std::wstring{ L"C:\\Windows\\System32\\combase.dll" });
+            clsid += Value<Type::String>(L"ThreadingModel", std::wstring{ L"Both" });
+            clsid += Value<Type::Dword>(L"DisplayName", 1);
+        }
+    }
+
+    {
+        //CLSID-style names
+        auto indexSubKey = testKey.create(L"Index");
+        for (auto i = 0; i < 2000; ++i)
+        {
+            wchar_t name[64]{};
+            swprintf(name, std::size(name), L"{%08x-0000-0000-C000-000000000046}", i);
+            indexSubKey.create(name);
+        }
+    }
+
+    {
+        auto querySubKey = testKey.create(L"Query");
+        for (auto path : { L"App1\\Uninstall\\X", L"App1\\Uninstall\\Y", L"App2\\Uninstall\\X", L"Other\\Data" })
+            querySubKey.create(path) += Value<Type::String>(L"DisplayName", std::wstring{ path });
+    }
 }
 
 int main(int argc, char **argv) 